@@ -0,0 +1,113 @@
+/*
+ * Checks that Halon_queue_insert_callback does not allocate in the common
+ * case, with memo hits, memo misses, values too large to memoize and after
+ * warmups are published, by counting calls to operator new.
+ */
+#include "../policyd-client.cpp"
+#include "stub/stub.h"
+#include <new>
+
+static std::atomic<uint64_t> allocations(0);
+
+__attribute__((noinline)) void* operator new(size_t size)
+{
+	allocations++;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+static int failures = 0;
+
+// inserts each message in turn, rounds times, and expects no allocations
+static void check(const char* name, HalonQueueContext& hqc, std::vector<HalonQueueMessage>& messages, size_t expect_ips, size_t rounds = 100)
+{
+	uint64_t before = allocations;
+	size_t ips = 0;
+	for (size_t r = 0; r < rounds; ++r)
+	{
+		for (auto& message : messages)
+		{
+			hqc.message = &message;
+			hqc.localips_set = false;
+			Halon_queue_insert_callback(&hqc);
+			ips += hqc.localips_set ? hqc.localips_result_count : hqc.localips.size();
+		}
+	}
+	uint64_t n = allocations - before;
+	size_t calls = rounds * messages.size();
+	bool ok = n == 0 && ips == expect_ips * calls;
+	printf("%s: %s, %lu allocations in %zu calls, %zu ips kept per call\n", name, ok ? "ok" : "FAILED", (unsigned long)n, calls, calls ? ips / calls : 0);
+	if (!ok)
+		failures++;
+}
+
+int main()
+{
+	// two of four ips are warmed up for gmail.com only, the others have no warmup
+	addWarmup(UUIDType::POLICY, "p1", "192.0.2.1", { HALONMTA_QUEUE_RECIPIENTDOMAIN, { "gmail.com" } });
+	addWarmup(UUIDType::POLICY, "p2", "192.0.2.0/30", { HALONMTA_QUEUE_RECIPIENTDOMAIN | HALONMTA_QUEUE_TENANTID, { "gmail.com", "t1" } });
+	warmupsPublish();
+
+	std::vector<std::string> ips = { "192.0.2.1", "192.0.2.2", "198.51.100.1", "2001:db8::1" };
+	HalonQueueContext hqc;
+	for (auto& ip : ips)
+		hqc.localips.push_back(&ip[0]);
+
+	std::vector<HalonQueueMessage> same(1);
+	same[0].values[HALONMTA_MESSAGE_RECIPIENTDOMAIN] = "yahoo.com";
+	same[0].values[HALONMTA_MESSAGE_TENANTID] = "t1";
+
+	// more distinct messages than memo slots, so that every call misses
+	std::vector<HalonQueueMessage> distinct(4096);
+	for (size_t i = 0; i < distinct.size(); ++i)
+	{
+		distinct[i].values[HALONMTA_MESSAGE_RECIPIENTDOMAIN] = "d" + std::to_string(i) + ".example";
+		distinct[i].values[HALONMTA_MESSAGE_TENANTID] = "t1";
+	}
+
+	std::vector<HalonQueueMessage> match(1);
+	match[0].values[HALONMTA_MESSAGE_RECIPIENTDOMAIN] = "gmail.com";
+	match[0].values[HALONMTA_MESSAGE_TENANTID] = "t1";
+
+	std::vector<HalonQueueMessage> large(1);
+	large[0].values[HALONMTA_MESSAGE_RECIPIENTDOMAIN] = std::string(300, 'x') + ".example";
+
+	// the first call of a thread may set up its memo
+	hqc.message = &same[0];
+	Halon_queue_insert_callback(&hqc);
+
+	uint64_t hits = Stats.insert_memo_hits;
+	check("memo hit", hqc, same, 2);
+	if (Stats.insert_memo_hits - hits < 100)
+	{
+		printf("memo hit: FAILED, the memo was not used\n");
+		failures++;
+	}
+	check("memo hit, all kept", hqc, match, 4);
+	uint64_t misses = Stats.insert_memo_misses;
+	check("memo miss", hqc, distinct, 2, 2);
+	if (Stats.insert_memo_misses - misses < distinct.size() * 2)
+	{
+		printf("memo miss: FAILED, calls were memoized\n");
+		failures++;
+	}
+	check("not memoized", hqc, large, 2);
+
+	cleanupWarmup(UUIDType::POLICY, "p1");
+	warmupsPublish();
+	check("new generation", hqc, same, 2);
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Synthetic policyd streams for the benchmarks, shaped like a production
+ * sync: warmup policies per local ip and recipient domain, and a suspend
+ * for every tenth ip.
+ */
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static const char* const benchDomains[] = { "gmail.com", "yahoo.com", "outlook.com", "hotmail.com", "icloud.com", "aol.com", "gmx.de", "web.de", "orange.fr", "comcast.net" };
+
+static std::string benchLocalIp(size_t i)
+{
+	return "10." + std::to_string(i >> 16 & 0xff) + "." + std::to_string(i >> 8 & 0xff) + "." + std::to_string(i & 0xff);
+}
+
+static std::string benchPolicyId(size_t i)
+{
+	char id[48];
+	snprintf(id, sizeof(id), "%08zx-0000-4000-8000-%012zx", i, (i * 2654435761u) & 0xffffffffffff);
+	return id;
+}
+
+// the policy or suspend of operation i, as a JSON object
+static std::string benchOperation(size_t i, const char* action = "CREATE", size_t concurrency = 10)
+{
+	size_t ip = i / (sizeof(benchDomains) / sizeof(benchDomains[0]));
+	const char* domain = benchDomains[i % (sizeof(benchDomains) / sizeof(benchDomains[0]))];
+	if (i % 100 == 99)
+		return std::string("{\"action\":\"") + action + "\",\"suspend\":{\"id\":\"" + benchPolicyId(i) + "\",\"type\":\"WARMUP\",\"localip\":\"" + benchLocalIp(ip) + "\",\"tag\":\"warmup-suspend\"}}";
+	return std::string("{\"action\":\"") + action + "\",\"policy\":{\"id\":\"" + benchPolicyId(i) + "\",\"type\":\"WARMUP\",\"fields\":[\"LOCALIP\",\"RECIPIENTDOMAIN\"]," +
+		   "\"if\":{\"localip\":\"" + benchLocalIp(ip) + "\",\"recipientdomain\":\"" + domain + "\"}," +
+		   "\"then\":{\"concurrency\":" + std::to_string(concurrency) + ",\"rate\":{\"count\":100,\"interval\":3600,\"algorithm\":\"TOKENBUCKET\"}," +
+		   "\"connectinterval\":0.5,\"tag\":\"warmup-day-" + std::to_string(i % 30) + "\",\"properties\":{\"stage\":\"" + std::to_string(i % 7) + "\"}}}}";
+}
+
+// a whole sync of count operations, batched if batch > 1
+static std::vector<std::string> benchSync(size_t count, size_t batch = 1)
+{
+	std::vector<std::string> frames;
+	frames.push_back("{\"action\":\"VERSION\",\"version\":1}");
+	for (size_t i = 0; i < count; i += batch)
+	{
+		if (batch <= 1)
+		{
+			frames.push_back(benchOperation(i));
+			continue;
+		}
+		std::string frame = "{\"action\":\"BATCH\",\"operations\":[";
+		for (size_t j = i; j < i + batch && j < count; ++j)
+		{
+			if (j != i)
+				frame += ",";
+			frame += benchOperation(j);
+		}
+		frames.push_back(frame + "]}");
+	}
+	frames.push_back("{\"action\":\"SYNCED\"}");
+	return frames;
+}
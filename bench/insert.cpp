@@ -0,0 +1,164 @@
+/*
+ * Halon_queue_insert_callback benchmark against the stub MTA. Sweeps the
+ * local ips of a message, the warmup conditions per ip, the fields they
+ * match on, the distinct messages (memo hits or misses) and the inserting
+ * threads, optionally with a writer thread publishing warmups meanwhile.
+ * Prints a JSON line per combination.
+ *
+ * usage: insert [--quick] [--ms n]
+ */
+#include "../policyd-client.cpp"
+#include "stub/stub.h"
+
+// fields matched on, widest last, and the message fields they read
+static const int insertMasks[] = {
+	HALONMTA_QUEUE_RECIPIENTDOMAIN,
+	HALONMTA_QUEUE_RECIPIENTDOMAIN | HALONMTA_QUEUE_TENANTID,
+	HALONMTA_QUEUE_REMOTEMX | HALONMTA_QUEUE_RECIPIENTDOMAIN | HALONMTA_QUEUE_GROUPING | HALONMTA_QUEUE_TENANTID,
+};
+
+struct InsertCase
+{
+	size_t ips;
+	size_t conditions;
+	int fields;
+	size_t keys; // distinct messages
+	size_t threads;
+	bool writer;
+};
+
+static std::vector<std::string> insertIds;
+
+static std::string insertDomain(size_t k)
+{
+	return "d" + std::to_string(k) + ".example";
+}
+
+// the values of condition k, in warmupFields order
+static std::vector<std::string> insertValues(int fields, size_t k)
+{
+	std::vector<std::string> values;
+	for (const auto& f : warmupFields)
+	{
+		if (!(fields & f.first))
+			continue;
+		if (f.first == HALONMTA_QUEUE_RECIPIENTDOMAIN)
+			values.push_back(insertDomain(k));
+		else
+			values.push_back("v" + std::to_string(f.first));
+	}
+	return values;
+}
+
+static void insertWarmups(const InsertCase& c, size_t round)
+{
+	for (const auto& id : insertIds)
+		cleanupWarmup(UUIDType::POLICY, id);
+	insertIds.clear();
+	for (size_t ip = 0; ip < c.ips; ++ip)
+	{
+		for (size_t k = 0; k < c.conditions; ++k)
+		{
+			// the round shifts one condition, so that a writer changes what matches
+			std::string id = std::to_string(ip) + "-" + std::to_string(k);
+			addWarmup(UUIDType::POLICY, id, "10.0.0." + std::to_string(ip), { c.fields, insertValues(c.fields, k == 0 ? round % c.keys : k) });
+			insertIds.push_back(id);
+		}
+	}
+	warmupsPublish();
+}
+
+static void insertRun(const InsertCase& c, int ms)
+{
+	insertWarmups(c, 0);
+
+	std::vector<std::string> ips;
+	for (size_t ip = 0; ip < c.ips; ++ip)
+		ips.push_back("10.0.0." + std::to_string(ip));
+	std::vector<HalonQueueMessage> messages(c.keys);
+	for (size_t k = 0; k < c.keys; ++k)
+	{
+		messages[k].values[HALONMTA_MESSAGE_RECIPIENTDOMAIN] = insertDomain(k);
+		messages[k].values[HALONMTA_MESSAGE_REMOTEMX] = "v" + std::to_string(HALONMTA_QUEUE_REMOTEMX);
+		messages[k].values[HALONMTA_MESSAGE_GROUPING] = "v" + std::to_string(HALONMTA_QUEUE_GROUPING);
+		messages[k].values[HALONMTA_MESSAGE_TENANTID] = "v" + std::to_string(HALONMTA_QUEUE_TENANTID);
+	}
+
+	uint64_t hits = Stats.insert_memo_hits, misses = Stats.insert_memo_misses;
+	std::atomic<bool> done(false);
+	std::atomic<uint64_t> inserts(0), publishes(0);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < c.threads; ++t)
+	{
+		threads.emplace_back([&, t]() {
+			HalonQueueContext hqc;
+			for (auto& ip : ips)
+				hqc.localips.push_back(&ip[0]);
+			uint64_t n = 0;
+			for (size_t k = t; !done.load(std::memory_order_relaxed); k = (k + 1) % c.keys, ++n)
+			{
+				hqc.message = &messages[k];
+				hqc.localips_set = false;
+				Halon_queue_insert_callback(&hqc);
+			}
+			inserts += n;
+		});
+	}
+	std::thread writer;
+	if (c.writer)
+	{
+		writer = std::thread([&]() {
+			for (size_t round = 1; !done.load(std::memory_order_relaxed); ++round)
+			{
+				insertWarmups(c, round);
+				publishes++;
+				usleep(1000);
+			}
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	usleep((useconds_t)ms * 1000);
+	done = true;
+	for (auto& t : threads)
+		t.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	if (writer.joinable())
+		writer.join();
+
+	hits = Stats.insert_memo_hits - hits;
+	misses = Stats.insert_memo_misses - misses;
+	printf("{\"bench\":\"insert\",\"ips\":%zu,\"conditions\":%zu,\"fields\":%d,\"keys\":%zu,\"threads\":%zu,\"writer\":%s,"
+		   "\"inserts_per_s\":%.0f,\"ns_per_insert\":%.1f,\"memo_hit_rate\":%.3f,\"publishes\":%lu}\n",
+		c.ips, c.conditions, __builtin_popcount((unsigned)c.fields), c.keys, c.threads, c.writer ? "true" : "false",
+		(double)inserts / seconds, seconds * 1e9 * (double)c.threads / (double)inserts, hits + misses ? (double)hits / (double)(hits + misses) : 0,
+		(unsigned long)publishes.load());
+	fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+	bool quick = false;
+	int ms = 200;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--quick") == 0)
+			quick = true;
+		else if (strcmp(argv[i], "--ms") == 0 && i + 1 < argc)
+			ms = atoi(argv[++i]);
+	}
+	if (quick)
+		ms = 20;
+
+	std::vector<size_t> ipss = { 1, 8, 64 }, conditionss = { 1, 16, 256 }, keyss = { 16, 4096 }, threadss = { 1, 2, 4 };
+	if (quick)
+		ipss = { 8 }, conditionss = { 16 }, threadss = { 1, 2 };
+	for (size_t ips : ipss)
+		for (size_t conditions : conditionss)
+			for (int fields : insertMasks)
+				for (size_t keys : keyss)
+					for (size_t threads : threadss)
+						for (bool writer : { false, true })
+							insertRun({ ips, conditions, fields, keys, threads, writer }, ms);
+	return 0;
+}
@@ -0,0 +1,98 @@
+/*
+ * Frame parsing benchmark: the in-place FrameParser of the plugin against a
+ * jsoncpp DOM, which it replaced, on the frames of a synthetic sync. Reports
+ * ns per frame and MB/s for parsing alone and for decodeItem, which parses and
+ * decodes into the reused specs, as a JSON line per parser and batch size.
+ *
+ * usage: parse [--ms n] [count]
+ */
+#include "../policyd-client.cpp"
+#include "frames.h"
+#include <json/json.h>
+
+struct ParseResult
+{
+	size_t frames = 0;
+	size_t bytes = 0;
+	size_t failed = 0;
+	double seconds = 0;
+};
+
+// runs parse over all frames until ms have passed
+template <typename F>
+static ParseResult parseRun(const std::vector<std::string>& frames, int ms, F parse)
+{
+	ParseResult result;
+	auto start = std::chrono::steady_clock::now();
+	auto until = start + std::chrono::milliseconds(ms);
+	do
+	{
+		for (const auto& frame : frames)
+		{
+			if (!parse(frame))
+				result.failed++;
+			result.bytes += frame.size();
+		}
+		result.frames += frames.size();
+	} while (std::chrono::steady_clock::now() < until);
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return result;
+}
+
+static void parsePrint(const char* parser, size_t batch, const ParseResult& result)
+{
+	printf("{\"bench\":\"parse\",\"parser\":\"%s\",\"batch\":%zu,\"frames\":%zu,\"ns_per_frame\":%.1f,\"mb_per_s\":%.1f,\"failed\":%zu}\n",
+		parser, batch, result.frames, result.seconds * 1e9 / (double)result.frames, (double)result.bytes / result.seconds / 1e6, result.failed);
+	fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+	int ms = 500;
+	size_t count = 10000;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--ms") == 0 && i + 1 < argc)
+			ms = atoi(argv[++i]);
+		else
+			count = strtoul(argv[i], nullptr, 10);
+	}
+
+	int status = 0;
+	for (size_t batch : { 1, 100 })
+	{
+		std::vector<std::string> frames = benchSync(count, batch);
+
+		// the DOM of the previous implementation, with the reader it used
+		Json::CharReaderBuilder builder;
+		std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+		ParseResult jsoncpp = parseRun(frames, ms, [&](const std::string& frame) {
+			Json::Value value;
+			std::string errs;
+			return reader->parse(frame.data(), frame.data() + frame.size(), &value, &errs);
+		});
+		parsePrint("jsoncpp", batch, jsoncpp);
+
+		// in place, so each frame is first copied as the pipeline owns it
+		FrameParser parser;
+		std::string copy;
+		ParseResult insitu = parseRun(frames, ms, [&](const std::string& frame) {
+			copy.assign(frame);
+			return parser.parseJson(&copy[0], copy.size());
+		});
+		parsePrint("insitu", batch, insitu);
+
+		PipelineItem item;
+		DecodedItem decoded;
+		ParseResult decode = parseRun(frames, ms, [&](const std::string& frame) {
+			item.frame.assign(frame);
+			decodeItem(parser, item, decoded);
+			return decoded.parsed && decoded.count;
+		});
+		parsePrint("insitu-decode", batch, decode);
+
+		if (jsoncpp.failed || insitu.failed || decode.failed)
+			status = 1;
+	}
+	return status;
+}
@@ -0,0 +1,248 @@
+#include "policyd.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstring>
+
+Policyd::~Policyd()
+{
+	stop();
+}
+
+bool Policyd::start()
+{
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (listen_fd < 0 || wake_fd < 0)
+		return false;
+	int on = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	sockaddr_in sin = {};
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(sin);
+	if (bind(listen_fd, (sockaddr*)&sin, sizeof(sin)) != 0 || listen(listen_fd, 8) != 0 || getsockname(listen_fd, (sockaddr*)&sin, &len) != 0)
+		return false;
+	port = ntohs(sin.sin_port);
+	thread = std::thread([this]() { run(); });
+	return true;
+}
+
+void Policyd::stop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	if (wake_fd >= 0)
+	{
+		uint64_t one = 1;
+		(void)write(wake_fd, &one, sizeof(one));
+	}
+	if (thread.joinable())
+		thread.join();
+	if (listen_fd >= 0)
+		close(listen_fd);
+	if (wake_fd >= 0)
+		close(wake_fd);
+	listen_fd = wake_fd = -1;
+}
+
+std::string Policyd::address() const
+{
+	return "ws://127.0.0.1:" + std::to_string(port) + "/";
+}
+
+void Policyd::script(const Connection& connection)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	pending.push_back(connection);
+}
+
+void Policyd::drop()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		dropping = true;
+	}
+	uint64_t one = 1;
+	(void)write(wake_fd, &one, sizeof(one));
+}
+
+size_t Policyd::accepted()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return requests.size();
+}
+
+std::string Policyd::request(size_t index)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return index < requests.size() ? requests[index] : std::string();
+}
+
+std::chrono::steady_clock::time_point Policyd::acceptedAt(size_t index)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return index < times.size() ? times[index] : std::chrono::steady_clock::time_point();
+}
+
+static void frameAppend(std::string& out, const std::string& payload, int opcode)
+{
+	out += (char)(0x80 | opcode);
+	size_t n = payload.size();
+	if (n < 126)
+		out += (char)n;
+	else if (n < 65536)
+	{
+		out += (char)126;
+		out += (char)(n >> 8);
+		out += (char)n;
+	}
+	else
+	{
+		out += (char)127;
+		for (int i = 7; i >= 0; --i)
+			out += (char)(n >> (i * 8));
+	}
+	out += payload;
+}
+
+static bool sendAll(int fd, const std::string& data)
+{
+	for (size_t sent = 0; sent < data.size();)
+	{
+		ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			return false;
+		sent += (size_t)n;
+	}
+	return true;
+}
+
+// Sec-WebSocket-Accept for a Sec-WebSocket-Key (RFC 6455)
+static std::string acceptKey(const std::string& request)
+{
+	std::string key;
+	for (size_t p = 0; (p = request.find("\r\n", p)) != std::string::npos;)
+	{
+		p += 2;
+		if (strncasecmp(request.c_str() + p, "Sec-WebSocket-Key:", 18) != 0)
+			continue;
+		size_t b = request.find_first_not_of(' ', p + 18), e = request.find("\r\n", b);
+		key = request.substr(b, e - b);
+		break;
+	}
+	key += "258EAFA5-E914-47DA-95CA-C5AB0E85B11B";
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	SHA1((const unsigned char*)key.data(), key.size(), digest);
+	unsigned char encoded[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+	EVP_EncodeBlock(encoded, digest, SHA_DIGEST_LENGTH);
+	return (const char*)encoded;
+}
+
+void Policyd::run()
+{
+	while (true)
+	{
+		pollfd fds[2] = { { listen_fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 } };
+		poll(fds, 2, -1);
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (stopping)
+				return;
+		}
+		if (fds[1].revents)
+		{
+			uint64_t v;
+			(void)read(wake_fd, &v, sizeof(v));
+		}
+		if (!fds[0].revents)
+			continue;
+		int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		std::string request;
+		char buf[4096];
+		while (request.find("\r\n\r\n") == std::string::npos)
+		{
+			ssize_t n = recv(fd, buf, sizeof(buf), 0);
+			if (n <= 0)
+				break;
+			request.append(buf, (size_t)n);
+		}
+
+		Connection connection;
+		bool scripted;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			scripted = !pending.empty();
+			if (scripted)
+			{
+				connection = std::move(pending.front());
+				pending.pop_front();
+				requests.push_back(request);
+				times.push_back(std::chrono::steady_clock::now());
+				dropping = false;
+			}
+		}
+		if (!scripted)
+		{
+			sendAll(fd, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n");
+			close(fd);
+			continue;
+		}
+		if (!serve(fd, connection))
+			return;
+	}
+}
+
+// returns false if stopped while holding the connection open
+bool Policyd::serve(int fd, const Connection& connection)
+{
+	std::string out = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n";
+	out += "Sec-WebSocket-Accept: " + acceptKey(requests.back()) + "\r\n";
+	for (const auto& header : connection.headers)
+		out += header + "\r\n";
+	out += "\r\n";
+	for (const auto& frame : connection.frames)
+		frameAppend(out, frame.payload, frame.binary ? 2 : 1);
+
+	bool running = true;
+	if (sendAll(fd, out) && !connection.close)
+	{
+		// hold it open until dropped, stopped or closed by the plugin
+		while (true)
+		{
+			pollfd fds[2] = { { fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 } };
+			poll(fds, 2, -1);
+			if (fds[1].revents)
+			{
+				uint64_t v;
+				(void)read(wake_fd, &v, sizeof(v));
+			}
+			{
+				std::lock_guard<std::mutex> guard(lock);
+				if (stopping)
+					running = false;
+				if (stopping || dropping)
+					break;
+			}
+			char buf[4096];
+			if (fds[0].revents && recv(fd, buf, sizeof(buf), 0) <= 0)
+				break;
+		}
+	}
+	std::string bye;
+	frameAppend(bye, "", 8);
+	sendAll(fd, bye);
+	close(fd);
+	return running;
+}
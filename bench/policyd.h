@@ -0,0 +1,68 @@
+/*
+ * A local stand-in for policyd, a websocket server on 127.0.0.1 that replays
+ * a scripted stream of frames to each connection in turn. Frames are encoded
+ * before the connection is accepted, so that sending them costs little next
+ * to what the plugin does with them.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Policyd
+{
+  public:
+	struct Frame
+	{
+		std::string payload;
+		bool binary = false;
+	};
+
+	// what is sent to a connection, which is then held open until drop() unless closed
+	struct Connection
+	{
+		std::vector<Frame> frames;
+		bool close = false;
+		std::vector<std::string> headers; // added to the upgrade response
+	};
+
+	~Policyd();
+
+	bool start();
+	void stop();
+
+	// the url to configure as address
+	std::string address() const;
+
+	// scripts the next connection, connections without a script are refused
+	void script(const Connection& connection);
+
+	// closes the connection being held open, if any
+	void drop();
+
+	// connections accepted so far, and their upgrade requests
+	size_t accepted();
+	std::string request(size_t index);
+	std::chrono::steady_clock::time_point acceptedAt(size_t index);
+
+  private:
+	void run();
+	bool serve(int fd, const Connection& connection);
+
+	int listen_fd = -1;
+	int wake_fd = -1;
+	int port = 0;
+	std::thread thread;
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<Connection> pending;
+	bool dropping = false;
+	bool stopping = false;
+	std::vector<std::string> requests;
+	std::vector<std::chrono::steady_clock::time_point> times;
+};
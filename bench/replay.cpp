@@ -0,0 +1,134 @@
+/*
+ * Applies a capture recorded by the plugin (Config.capture) again, through
+ * the same pipeline and apply thread but into the stub MTA, to reproduce and
+ * profile a sync offline. Events are queued at the recorded pace, or faster
+ * with --speed (a multiplier, 0 for as fast as possible). Prints a JSON line.
+ *
+ * usage: replay [--speed x] capture
+ */
+#include "../policyd-client.cpp"
+#include "stub/stub.h"
+
+static bool captureGet(FILE* fp, uint64_t& v)
+{
+	return fread(&v, sizeof(v), 1, fp) == 1;
+}
+
+static bool captureGet(FILE* fp, std::string& v)
+{
+	uint64_t l;
+	if (!captureGet(fp, l) || l > (1ULL << 32))
+		return false;
+	v.resize(l);
+	return fread(&v[0], 1, l, fp) == l;
+}
+
+struct ReplayResult
+{
+	uint64_t frames = 0;
+	uint64_t connections = 0;
+	uint64_t disconnected = 0; // DISCONNECTED queued
+};
+
+// queue the events of a capture as if they were received
+static bool replayCapture(Pipeline& pipeline, const char* path, double speed, ReplayResult& result)
+{
+	FILE* fp = fopen(path, "r");
+	if (!fp)
+	{
+		fprintf(stderr, "replay: Failed to open capture %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	char magic[sizeof(captureMagic)];
+	if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) || memcmp(magic, captureMagic, sizeof(magic)) != 0)
+	{
+		fprintf(stderr, "replay: Invalid capture %s\n", path);
+		fclose(fp);
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	PipelineItem item;
+	uint64_t ns, event, binary;
+	bool connected = false;
+	// a truncated last event is from a capture that was still being written
+	while (captureGet(fp, ns) && captureGet(fp, event) && captureGet(fp, binary) && captureGet(fp, item.frame))
+	{
+		if (event >= (uint64_t)PipelineEvent::QUIT)
+			continue;
+		if (speed > 0)
+			std::this_thread::sleep_until(start + std::chrono::nanoseconds((uint64_t)((double)ns / speed)));
+		item.event = (PipelineEvent)event;
+		item.binary = binary != 0;
+		if (item.event == PipelineEvent::FRAME)
+			++result.frames;
+		else if (item.event == PipelineEvent::CONNECTED)
+		{
+			connected = true;
+			++result.connections;
+		}
+		else if (item.event == PipelineEvent::DISCONNECTED)
+		{
+			connected = false;
+			++result.disconnected;
+		}
+		pipelinePush(pipeline, item);
+	}
+	fclose(fp);
+
+	// as if the connection was closed at the end of the capture
+	if (connected)
+	{
+		item = { PipelineEvent::DISCONNECTED, {} };
+		pipelinePush(pipeline, item);
+		++result.disconnected;
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	double speed = 1;
+	const char* path = nullptr;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc)
+			speed = strtod(argv[++i], nullptr);
+		else
+			path = argv[i];
+	}
+	if (!path)
+	{
+		fprintf(stderr, "usage: replay [--speed x] capture\n");
+		return 1;
+	}
+
+	SyncState state;
+	Pipeline pipeline;
+	pipeline.apply_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	pipeline.receive_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	std::thread applyThread([&state, &pipeline] { applyWorker(state, pipeline); });
+
+	auto start = std::chrono::steady_clock::now();
+	ReplayResult result;
+	bool ok = replayCapture(pipeline, path, speed, result);
+	while (pipeline.disconnected.load(std::memory_order_acquire) < result.disconnected)
+		waitEvent(pipeline.receive_fd, -1);
+	double replay_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	PipelineItem item{ PipelineEvent::QUIT, {} };
+	pipelinePush(pipeline, item);
+	applyThread.join();
+	close(pipeline.apply_fd);
+	close(pipeline.receive_fd);
+	if (!ok)
+		return 1;
+
+	double sync_ms = (double)Stats.sync_duration / 1e6;
+	printf("{\"bench\":\"replay\",\"speed\":%g,\"frames\":%lu,\"connections\":%lu,\"synced\":%s,\"replay_ms\":%.3f,\"sync_ms\":%.3f,\"frames_per_s\":%.0f,"
+		   "\"policy_add\":%lu,\"policy_update\":%lu,\"policy_delete\":%lu,\"suspend_add\":%lu,\"suspend_delete\":%lu}\n",
+		speed, (unsigned long)result.frames, (unsigned long)result.connections, ready ? "true" : "false", replay_ms, sync_ms, (double)result.frames / (replay_ms / 1e3),
+		(unsigned long)stub::calls.policy_add.load(), (unsigned long)stub::calls.policy_update.load(), (unsigned long)stub::calls.policy_delete.load(),
+		(unsigned long)stub::calls.suspend_add.load(), (unsigned long)stub::calls.suspend_delete.load());
+	return ready ? 0 : 1;
+}
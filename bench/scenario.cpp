@@ -0,0 +1,293 @@
+/*
+ * End-to-end scenarios: the plugin syncs from scripted policyd connections
+ * into the stub MTA, and the queue policy calls it makes are checked in
+ * order. A scenario runs in a process of its own, since the plugin only inits
+ * once.
+ *
+ * usage: scenario name
+ */
+#include "../policyd-client.cpp"
+#include "frames.h"
+#include "policyd.h"
+#include "stub/stub.h"
+#include <sys/wait.h>
+#include <functional>
+
+static bool waitFor(const std::function<bool()>& done, int seconds)
+{
+	auto until = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+	while (!done())
+	{
+		if (std::chrono::steady_clock::now() > until)
+			return false;
+		usleep(1000);
+	}
+	return true;
+}
+
+static int failures = 0;
+
+static void check(bool ok, const std::string& what)
+{
+	if (ok)
+		return;
+	failures++;
+	printf("FAILED: %s\n", what.c_str());
+}
+
+static Policyd::Connection connection(const std::vector<std::string>& frames, bool close = false)
+{
+	Policyd::Connection c;
+	for (const auto& frame : frames)
+		c.frames.push_back({ frame, false });
+	c.close = close;
+	return c;
+}
+
+// the operations of benchOperation(i) as the stub records them
+static std::string call(const char* name, size_t i)
+{
+	return std::string(name) + " " + benchPolicyId(i) + (strcmp(name, "policy_add") == 0 ? " " + benchLocalIp(i / 10) : "");
+}
+
+// waits for the calls recorded so far to be expected, exactly and in order
+static void expectCalls(const std::vector<std::string>& expected, const std::string& what)
+{
+	if (waitFor([&]() { return stub::recorded() == expected; }, 10))
+	{
+		// and that nothing follows
+		usleep(100000);
+		if (stub::recorded() == expected)
+			return;
+	}
+	check(false, what);
+	printf("expected:\n");
+	for (const auto& line : expected)
+		printf("  %s\n", line.c_str());
+	printf("recorded:\n");
+	for (const auto& line : stub::recorded())
+		printf("  %s\n", line.c_str());
+}
+
+static bool init(Policyd& policyd, const std::map<std::string, std::string>& config = {})
+{
+	if (!policyd.start())
+	{
+		check(false, "policyd listens");
+		return false;
+	}
+	HalonInitContext hic;
+	hic.config.object["address"] = policyd.address();
+	for (const auto& c : config)
+		hic.config.object[c.first] = c.second;
+	stub::record(true);
+	bool ok = Halon_init(&hic);
+	check(ok, "init");
+	return ok;
+}
+
+// CREATE, UPDATE and DELETE after SYNCED reach the MTA, an unchanged UPDATE does not
+static void operations()
+{
+	Policyd policyd;
+	policyd.script(connection({ benchSync(0)[0], benchOperation(0), benchOperation(1), benchOperation(2), "{\"action\":\"SYNCED\"}",
+		benchOperation(3), benchOperation(1, "UPDATE", 20), benchOperation(2, "UPDATE"), benchOperation(0, "DELETE") }));
+	if (!init(policyd))
+		return;
+	expectCalls({ call("policy_add", 0), call("policy_add", 1), call("policy_add", 2), call("policy_add", 3), call("policy_update", 1), call("policy_delete", 0) },
+		"operations are applied in order");
+	check(policyd.request(0).find("X-Policyd-Extensions: batch, revision, cbor, zstd") != std::string::npos, "extensions are advertised");
+	check(Stats.updates_skipped == 1, "the unchanged update is skipped");
+	Halon_cleanup();
+}
+
+// after a reconnect, SYNCED deletes what was not sent again
+static void stale()
+{
+	Policyd policyd;
+	std::vector<std::string> first = benchSync(5), second = benchSync(3);
+	second.insert(second.end() - 1, benchOperation(4));
+	policyd.script(connection(first, true));
+	policyd.script(connection(second));
+	if (!init(policyd))
+		return;
+	check(waitFor([]() { return Stats.frames[(size_t)FrameAction::SYNCED] >= 2; }, 10), "second sync");
+	expectCalls({ call("policy_add", 0), call("policy_add", 1), call("policy_add", 2), call("policy_add", 3), call("policy_add", 4), call("policy_delete", 3) },
+		"only the stale policy is deleted");
+	check(policyd.accepted() == 2 && stub::entries("policy") == 4, "four policies are left");
+	Halon_cleanup();
+}
+
+// a reconnect resumes from the last revision, a delta sync keeps what it does not send
+static void delta()
+{
+	Policyd policyd;
+	policyd.script(connection({ benchSync(0)[0], benchOperation(0), benchOperation(1), benchOperation(2), "{\"action\":\"SYNCED\",\"revision\":5}" }, true));
+	policyd.script(connection({ "{\"action\":\"VERSION\",\"version\":1,\"delta\":true}", benchOperation(3), benchOperation(1, "DELETE"), "{\"action\":\"SYNCED\",\"revision\":7}" }, true));
+	if (!init(policyd))
+		return;
+	check(waitFor([]() { return Stats.frames[(size_t)FrameAction::SYNCED] >= 2; }, 10), "delta sync");
+	expectCalls({ call("policy_add", 0), call("policy_add", 1), call("policy_add", 2), call("policy_add", 3), call("policy_delete", 1) },
+		"a delta sync deletes nothing it did not send");
+	check(policyd.request(0).find("X-Policyd-Revision") == std::string::npos, "no revision at first");
+	check(policyd.request(1).find("X-Policyd-Revision: 5\r\n") != std::string::npos, "the revision of the first sync");
+
+	// refused until scripted, then a full sync that is empty removes the rest
+	policyd.script(connection(benchSync(0)));
+	check(waitFor([]() { return Stats.frames[(size_t)FrameAction::SYNCED] >= 3; }, 10), "full sync");
+	check(policyd.request(2).find("X-Policyd-Revision: 7\r\n") != std::string::npos, "the revision of the delta sync");
+	expectCalls({ call("policy_add", 0), call("policy_add", 1), call("policy_add", 2), call("policy_add", 3), call("policy_delete", 1), call("policy_delete", 0),
+					call("policy_delete", 2), call("policy_delete", 3) },
+		"a full sync deletes what it does not send");
+	Halon_cleanup();
+}
+
+// within Config.update_window UPDATEs collapse, a DELETE cancels and a CREATE
+// supersedes a pending one, before SYNCED nothing is held and a disconnect flushes
+static void coalesce()
+{
+	Policyd policyd;
+	policyd.script(connection({ benchSync(0)[0], benchOperation(0), benchOperation(1), benchOperation(2), benchOperation(3), benchOperation(0, "UPDATE", 20),
+		"{\"action\":\"SYNCED\"}", benchOperation(1, "UPDATE", 20), benchOperation(1, "UPDATE", 30), benchOperation(2, "UPDATE", 20), benchOperation(2, "DELETE"),
+		benchOperation(3, "UPDATE", 20), benchOperation(3, "CREATE", 30) }));
+	if (!init(policyd, { { "update_window", "60" } }))
+		return;
+	expectCalls({ call("policy_add", 0), call("policy_add", 1), call("policy_add", 2), call("policy_add", 3), call("policy_update", 0), call("policy_delete", 2),
+					call("policy_update", 3) },
+		"only the update before SYNCED is applied right away");
+	check(Stats.updates_coalesced == 2 && Stats.updates_cancelled == 1, "one update is collapsed, one superseded and one cancelled");
+
+	policyd.drop();
+	expectCalls({ call("policy_add", 0), call("policy_add", 1), call("policy_add", 2), call("policy_add", 3), call("policy_update", 0), call("policy_delete", 2),
+					call("policy_update", 3), call("policy_update", 1) },
+		"the collapsed update is applied on disconnect");
+	Halon_cleanup();
+}
+
+// connections lost before SYNCED back off, and a sync resets the backoff
+static void backoff()
+{
+	Policyd policyd;
+	std::vector<std::string> unsynced = { benchSync(0)[0] };
+	policyd.script(connection(unsynced, true));
+	policyd.script(connection(unsynced, true));
+	policyd.script(connection(benchSync(0), true));
+	policyd.script(connection(unsynced, true));
+	policyd.script(connection(benchSync(0)));
+	if (!init(policyd))
+		return;
+	check(waitFor([&policyd]() { return policyd.accepted() == 5; }, 10), "five connections");
+	auto gap = [&policyd](size_t i) { return std::chrono::duration<double, std::milli>(policyd.acceptedAt(i) - policyd.acceptedAt(i - 1)).count(); };
+	// reconnectDelay() is from half of 100ms, doubled on each attempt
+	check(gap(1) >= 50, "a delay after the first unsynced connection");
+	check(gap(2) >= 100, "a longer delay after the second");
+	check(gap(3) < 50, "no delay after a sync");
+	check(gap(4) >= 50 && gap(4) < 200, "the delay starts over after a sync");
+	Halon_cleanup();
+}
+
+// a restart is ready from the cache before policyd is reached, and resumes from its revision
+static void cache()
+{
+	std::string path = "scenario-" + std::to_string(getpid()) + ".cache";
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		Policyd policyd;
+		policyd.script(connection({ benchSync(0)[0], benchOperation(0), benchOperation(1), benchOperation(2), "{\"action\":\"SYNCED\",\"revision\":3}" }));
+		bool ok = init(policyd, { { "cache", path } }) && waitFor([]() { return Stats.frames[(size_t)FrameAction::SYNCED] >= 1; }, 10);
+		Halon_cleanup();
+		_exit(ok && !failures ? 0 : 1);
+	}
+	int status;
+	check(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0, "the first run saves the cache");
+
+	// nothing is scripted yet, so policyd refuses
+	Policyd policyd;
+	auto start = std::chrono::steady_clock::now();
+	if (!init(policyd, { { "cache", path } }))
+		return;
+	check(std::chrono::steady_clock::now() - start < std::chrono::seconds(1) && policyd.accepted() == 0, "ready without policyd");
+	expectCalls({ call("policy_add", 0), call("policy_add", 1), call("policy_add", 2) }, "the cached policies are applied");
+
+	policyd.script(connection({ benchSync(0)[0], benchOperation(1), "{\"action\":\"SYNCED\",\"revision\":4}" }));
+	check(waitFor([]() { return Stats.frames[(size_t)FrameAction::SYNCED] >= 1; }, 10), "sync");
+	check(policyd.request(0).find("X-Policyd-Revision: 3\r\n") != std::string::npos, "the revision of the cache");
+	expectCalls({ call("policy_add", 0), call("policy_add", 1), call("policy_add", 2), call("policy_delete", 0), call("policy_delete", 2) },
+		"the sync reconciles the cached policies");
+	Halon_cleanup();
+	unlink(path.c_str());
+}
+
+// a small prefix is added as its addresses, a large one gets an entry for each
+// address the insert callback sees in it, until deleted or expired
+static void prefix()
+{
+	std::string p64 = benchPolicyId(1000), p30 = benchPolicyId(1001), s48 = benchPolicyId(1002), expiring = benchPolicyId(1003);
+	auto policy = [](const std::string& id, const char* localip, const char* extra) {
+		return "{\"action\":\"CREATE\",\"policy\":{\"id\":\"" + id + "\",\"type\":\"WARMUP\",\"fields\":[\"LOCALIP\",\"RECIPIENTDOMAIN\"],\"if\":{\"localip\":\"" + localip +
+			   "\",\"recipientdomain\":\"gmail.com\"},\"then\":{\"concurrency\":10}" + extra + "}}";
+	};
+	Policyd policyd;
+	policyd.script(connection({ benchSync(0)[0], policy(p64, "2001:db8::/64", ""), policy(p30, "192.0.2.0/30", ""),
+		"{\"action\":\"CREATE\",\"suspend\":{\"id\":\"" + s48 + "\",\"localip\":\"2001:db8::/48\"}}", policy(expiring, "2001:db8:1::/64", ",\"ttl\":1"),
+		"{\"action\":\"SYNCED\"}" }));
+	if (!init(policyd))
+		return;
+	std::vector<std::string> expected;
+	for (const char* ip : { "192.0.2.0", "192.0.2.1", "192.0.2.2", "192.0.2.3" })
+		expected.push_back("policy_add " + p30 + "@" + ip + " " + ip);
+	expectCalls(expected, "only the small prefix is added up front");
+
+	std::vector<std::string> ips = { "2001:db8::5", "2001:db8:1::5", "198.51.100.1" };
+	HalonQueueContext hqc;
+	for (auto& ip : ips)
+		hqc.localips.push_back(&ip[0]);
+	HalonQueueMessage message;
+	message.values[HALONMTA_MESSAGE_RECIPIENTDOMAIN] = "gmail.com";
+	hqc.message = &message;
+	Halon_queue_insert_callback(&hqc);
+	Halon_queue_insert_callback(&hqc);
+	expected.push_back("policy_add " + p64 + "@2001:db8::5 2001:db8::5");
+	expected.push_back("suspend_add " + s48 + "@2001:db8::5 2001:db8::5");
+	expected.push_back("policy_add " + expiring + "@2001:db8:1::5 2001:db8:1::5");
+	expectCalls(expected, "the addresses seen in large prefixes are added once");
+
+	// the mta expires its entries, a later DELETE has none to delete
+	check(waitFor([]() { return Stats.expired >= 1; }, 10), "expiry");
+	policyd.script(connection({ "{\"action\":\"VERSION\",\"version\":1,\"delta\":true}", "{\"action\":\"DELETE\",\"policy\":{\"id\":\"" + expiring + "\"}}",
+		"{\"action\":\"DELETE\",\"policy\":{\"id\":\"" + p64 + "\"}}", "{\"action\":\"SYNCED\"}" }));
+	policyd.drop();
+	expected.push_back("policy_delete " + expiring);
+	expected.push_back("policy_delete " + p64 + "@2001:db8::5");
+	expectCalls(expected, "deleted and expired prefixes are forgotten");
+	Halon_cleanup();
+}
+
+static const struct
+{
+	const char* name;
+	void (*run)();
+} scenarios[] = {
+	{ "operations", operations },
+	{ "stale", stale },
+	{ "delta", delta },
+	{ "coalesce", coalesce },
+	{ "backoff", backoff },
+	{ "cache", cache },
+	{ "prefix", prefix },
+};
+
+int main(int argc, char* argv[])
+{
+	for (const auto& s : scenarios)
+	{
+		if (argc != 2 || strcmp(argv[1], s.name) != 0)
+			continue;
+		s.run();
+		printf("%s: %s\n", s.name, failures ? "FAILED" : "ok");
+		return failures ? 1 : 0;
+	}
+	fprintf(stderr, "usage: scenario name\n");
+	return 1;
+}
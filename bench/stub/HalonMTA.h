@@ -0,0 +1,105 @@
+/*
+ * The part of the HalonMTA plugin API used by policyd-client, so that it can
+ * be built against the stub library in this directory instead of an installed
+ * MTA. Constants only need to be consistent with the stub, they are not the
+ * values of the real header.
+ */
+#pragma once
+
+#include <stddef.h>
+
+#define HALON_EXPORT extern "C" __attribute__((visibility("default")))
+
+#define HALONMTA_PLUGIN_VERSION 1
+
+struct HalonInitContext;
+struct HalonConfig;
+struct HalonQueueContext;
+struct HalonQueueMessage;
+struct HalonHSLValue;
+struct HalonHSLContext;
+struct HalonHSLArguments;
+struct HalonHSLRegisterContext;
+
+enum
+{
+	HALONMTA_INIT_CONFIG,
+	HALONMTA_INFO_LOCALIPS,
+	HALONMTA_INFO_MESSAGE,
+	HALONMTA_INFO_RETURN,
+};
+
+enum
+{
+	HALONMTA_QUEUE_TRANSPORTID = 1,
+	HALONMTA_QUEUE_LOCALIP = 2,
+	HALONMTA_QUEUE_REMOTEIP = 4,
+	HALONMTA_QUEUE_REMOTEMX = 8,
+	HALONMTA_QUEUE_RECIPIENTDOMAIN = 16,
+	HALONMTA_QUEUE_JOBID = 32,
+	HALONMTA_QUEUE_GROUPING = 64,
+	HALONMTA_QUEUE_TENANTID = 128,
+};
+
+enum
+{
+	HALONMTA_MESSAGE_TRANSACTIONID,
+	HALONMTA_MESSAGE_REMOTEIP,
+	HALONMTA_MESSAGE_REMOTEMX,
+	HALONMTA_MESSAGE_RECIPIENTDOMAIN,
+	HALONMTA_MESSAGE_JOBID,
+	HALONMTA_MESSAGE_GROUPING,
+	HALONMTA_MESSAGE_TENANTID,
+	HALONMTA_MESSAGE_COUNT, // not in the real header, the size of the stub message
+};
+
+enum
+{
+	HALONMTA_POLICY_TYPE_DYNAMIC,
+	HALONMTA_POLICY_TYPE_WARMUP,
+	HALONMTA_POLICY_TYPE_BACKOFF,
+};
+
+enum
+{
+	HALONMTA_RATE_ALGORITHM_DEFAULT,
+	HALONMTA_RATE_ALGORITHM_FIXEDWINDOW,
+	HALONMTA_RATE_ALGORITHM_TOKENBUCKET,
+};
+
+enum
+{
+	HALONMTA_HSL_TYPE_NONE,
+	HALONMTA_HSL_TYPE_STRING,
+	HALONMTA_HSL_TYPE_ARRAY,
+	HALONMTA_HSL_TYPE_NUMBER,
+	HALONMTA_HSL_TYPE_BOOLEAN,
+};
+
+extern "C"
+{
+	bool HalonMTA_init_getinfo(HalonInitContext* hic, int type, const void* hint, size_t hintlen, void* result, size_t* resultlen);
+
+	HalonConfig* HalonMTA_config_object_get(HalonConfig* cfg, const char* name);
+	HalonConfig* HalonMTA_config_array_get(HalonConfig* cfg, size_t index);
+	const char* HalonMTA_config_string_get(HalonConfig* cfg, size_t* len);
+
+	bool HalonMTA_queue_getinfo(HalonQueueContext* hqc, int type, const void* hint, size_t hintlen, void* result, size_t* resultlen);
+	bool HalonMTA_queue_setinfo(HalonQueueContext* hqc, int type, const void* value, size_t valuelen);
+	bool HalonMTA_message_getinfo(HalonQueueMessage* hqm, int type, const void* hint, size_t hintlen, void* result, size_t* resultlen);
+
+	char* HalonMTA_queue_policy_add6(const char* id, int fields, int type, const char* transportid, const char* localip, const char* remoteip, const char* remotemx, const char* recipientdomain, const char* jobid, const char* grouping, const char* tenantid, size_t concurrency, size_t tokens, double interval, int ratealgorithm, double connectinterval, const char* tag, const char* propv[], size_t propl, bool stop, bool cluster, double ttl);
+	bool HalonMTA_queue_policy_update4(const char* id, size_t concurrency, size_t tokens, double interval, int ratealgorithm, double connectinterval, const char* tag, const char* propv[], size_t propl, bool stop, bool cluster, double ttl);
+	bool HalonMTA_queue_policy_delete(const char* id);
+	char* HalonMTA_queue_suspend_add5(const char* id, const char* transportid, const char* localip, const char* remoteip, const char* remotemx, const char* recipientdomain, const char* jobid, const char* grouping, const char* tenantid, const char* tag, const char* propv[], size_t propl, double ttl);
+	bool HalonMTA_queue_suspend_delete(const char* id);
+
+	bool HalonMTA_hsl_register_function(HalonHSLRegisterContext* hhrc, const char* name, void (*function)(HalonHSLContext*, HalonHSLArguments*, HalonHSLValue*));
+	bool HalonMTA_hsl_context_getinfo(HalonHSLContext* hhc, int type, const void* hint, size_t hintlen, void* result, size_t* resultlen);
+	HalonHSLValue* HalonMTA_hsl_argument_get(HalonHSLArguments* args, size_t index);
+	int HalonMTA_hsl_value_type(HalonHSLValue* value);
+	bool HalonMTA_hsl_value_get(HalonHSLValue* value, int type, void* result, size_t* resultlen);
+	bool HalonMTA_hsl_value_set(HalonHSLValue* value, int type, const void* data, size_t datalen);
+	bool HalonMTA_hsl_value_array_add(HalonHSLValue* value, HalonHSLValue** key, HalonHSLValue** val);
+	bool HalonMTA_hsl_value_array_get(HalonHSLValue* value, size_t index, HalonHSLValue** key, HalonHSLValue** val);
+}
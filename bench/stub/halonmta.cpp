@@ -0,0 +1,241 @@
+#include "stub.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_set>
+
+namespace stub
+{
+	Calls calls;
+
+	static std::mutex lock;
+	static bool recording = false;
+	static std::vector<std::string> log;
+	static std::atomic<uint64_t> delay{ 0 };
+	static std::unordered_set<std::string> added[2]; // policies, suspends
+
+	void record(bool enable)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		recording = enable;
+		log.clear();
+	}
+
+	std::vector<std::string> recorded()
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return log;
+	}
+
+	void latency(uint64_t ns)
+	{
+		delay = ns;
+	}
+
+	size_t entries(const char* type)
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		return added[strcmp(type, "policy") == 0 ? 0 : 1].size();
+	}
+
+	static bool call(const char* name, size_t type, bool add, bool remove, const char* id, const char* localip)
+	{
+		uint64_t ns = delay;
+		if (ns)
+		{
+			auto until = std::chrono::steady_clock::now() + std::chrono::nanoseconds(ns);
+			while (std::chrono::steady_clock::now() < until)
+				;
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		bool ok = true;
+		if (add)
+			added[type].insert(id);
+		if (remove)
+			ok = added[type].erase(id) == 1;
+		if (recording)
+			log.push_back(std::string(name) + " " + id + (localip ? std::string(" ") + localip : ""));
+		return ok;
+	}
+}
+
+extern "C"
+{
+	bool HalonMTA_init_getinfo(HalonInitContext* hic, int type, const void* hint, size_t hintlen, void* result, size_t* resultlen)
+	{
+		if (type != HALONMTA_INIT_CONFIG)
+			return false;
+		*(HalonConfig**)result = &hic->config;
+		return true;
+	}
+
+	HalonConfig* HalonMTA_config_object_get(HalonConfig* cfg, const char* name)
+	{
+		if (!cfg)
+			return nullptr;
+		auto i = cfg->object.find(name);
+		return i != cfg->object.end() ? &i->second : nullptr;
+	}
+
+	HalonConfig* HalonMTA_config_array_get(HalonConfig* cfg, size_t index)
+	{
+		return cfg && index < cfg->array.size() ? &cfg->array[index] : nullptr;
+	}
+
+	const char* HalonMTA_config_string_get(HalonConfig* cfg, size_t* len)
+	{
+		if (!cfg || !cfg->isstring)
+			return nullptr;
+		if (len)
+			*len = cfg->string.size();
+		return cfg->string.c_str();
+	}
+
+	bool HalonMTA_queue_getinfo(HalonQueueContext* hqc, int type, const void* hint, size_t hintlen, void* result, size_t* resultlen)
+	{
+		switch (type)
+		{
+			case HALONMTA_INFO_LOCALIPS:
+				*(char***)result = hqc->localips.data();
+				*resultlen = hqc->localips.size();
+				return true;
+			case HALONMTA_INFO_MESSAGE:
+				*(HalonQueueMessage**)result = hqc->message;
+				return true;
+			case HALONMTA_INFO_RETURN:
+				*(HalonHSLValue**)result = &hqc->ret;
+				return true;
+		}
+		return false;
+	}
+
+	bool HalonMTA_queue_setinfo(HalonQueueContext* hqc, int type, const void* value, size_t valuelen)
+	{
+		if (type != HALONMTA_INFO_LOCALIPS || valuelen > sizeof(hqc->localips_result) / sizeof(hqc->localips_result[0]))
+			return false;
+		hqc->localips_set = true;
+		hqc->localips_result_count = valuelen;
+		memcpy(hqc->localips_result, value, valuelen * sizeof(const char*));
+		return true;
+	}
+
+	bool HalonMTA_message_getinfo(HalonQueueMessage* hqm, int type, const void* hint, size_t hintlen, void* result, size_t* resultlen)
+	{
+		if (type < 0 || type >= HALONMTA_MESSAGE_COUNT)
+			return false;
+		*(const char**)result = hqm->values[type].c_str();
+		if (resultlen)
+			*resultlen = hqm->values[type].size();
+		return true;
+	}
+
+	char* HalonMTA_queue_policy_add6(const char* id, int fields, int type, const char* transportid, const char* localip, const char* remoteip, const char* remotemx, const char* recipientdomain, const char* jobid, const char* grouping, const char* tenantid, size_t concurrency, size_t tokens, double interval, int ratealgorithm, double connectinterval, const char* tag, const char* propv[], size_t propl, bool stop, bool cluster, double ttl)
+	{
+		stub::calls.policy_add++;
+		stub::call("policy_add", 0, true, false, id, localip);
+		return strdup(id);
+	}
+
+	bool HalonMTA_queue_policy_update4(const char* id, size_t concurrency, size_t tokens, double interval, int ratealgorithm, double connectinterval, const char* tag, const char* propv[], size_t propl, bool stop, bool cluster, double ttl)
+	{
+		stub::calls.policy_update++;
+		return stub::call("policy_update", 0, false, false, id, nullptr);
+	}
+
+	bool HalonMTA_queue_policy_delete(const char* id)
+	{
+		stub::calls.policy_delete++;
+		return stub::call("policy_delete", 0, false, true, id, nullptr);
+	}
+
+	char* HalonMTA_queue_suspend_add5(const char* id, const char* transportid, const char* localip, const char* remoteip, const char* remotemx, const char* recipientdomain, const char* jobid, const char* grouping, const char* tenantid, const char* tag, const char* propv[], size_t propl, double ttl)
+	{
+		stub::calls.suspend_add++;
+		stub::call("suspend_add", 1, true, false, id, localip);
+		return strdup(id);
+	}
+
+	bool HalonMTA_queue_suspend_delete(const char* id)
+	{
+		stub::calls.suspend_delete++;
+		return stub::call("suspend_delete", 1, false, true, id, nullptr);
+	}
+
+	bool HalonMTA_hsl_register_function(HalonHSLRegisterContext* hhrc, const char* name, void (*function)(HalonHSLContext*, HalonHSLArguments*, HalonHSLValue*))
+	{
+		hhrc->functions[name] = function;
+		return true;
+	}
+
+	bool HalonMTA_hsl_context_getinfo(HalonHSLContext* hhc, int type, const void* hint, size_t hintlen, void* result, size_t* resultlen)
+	{
+		if (type != HALONMTA_INFO_MESSAGE)
+			return false;
+		*(HalonQueueMessage**)result = hhc->message;
+		return true;
+	}
+
+	HalonHSLValue* HalonMTA_hsl_argument_get(HalonHSLArguments* args, size_t index)
+	{
+		return index < args->values.size() ? args->values[index] : nullptr;
+	}
+
+	int HalonMTA_hsl_value_type(HalonHSLValue* value)
+	{
+		return value->type;
+	}
+
+	bool HalonMTA_hsl_value_get(HalonHSLValue* value, int type, void* result, size_t* resultlen)
+	{
+		if (value->type != type)
+			return false;
+		switch (type)
+		{
+			case HALONMTA_HSL_TYPE_STRING:
+				*(char**)result = (char*)value->string.c_str();
+				if (resultlen)
+					*resultlen = value->string.size();
+				return true;
+			case HALONMTA_HSL_TYPE_NUMBER:
+				*(double*)result = value->number;
+				return true;
+		}
+		return false;
+	}
+
+	bool HalonMTA_hsl_value_set(HalonHSLValue* value, int type, const void* data, size_t datalen)
+	{
+		value->type = type;
+		value->array.clear();
+		switch (type)
+		{
+			case HALONMTA_HSL_TYPE_STRING:
+				value->string = datalen ? std::string((const char*)data, datalen) : std::string((const char*)data);
+				break;
+			case HALONMTA_HSL_TYPE_NUMBER:
+				value->number = *(const double*)data;
+				break;
+		}
+		return true;
+	}
+
+	bool HalonMTA_hsl_value_array_add(HalonHSLValue* value, HalonHSLValue** key, HalonHSLValue** val)
+	{
+		if (value->type != HALONMTA_HSL_TYPE_ARRAY)
+			return false;
+		value->array.emplace_back(std::make_unique<HalonHSLValue>(), std::make_unique<HalonHSLValue>());
+		*key = value->array.back().first.get();
+		*val = value->array.back().second.get();
+		return true;
+	}
+
+	bool HalonMTA_hsl_value_array_get(HalonHSLValue* value, size_t index, HalonHSLValue** key, HalonHSLValue** val)
+	{
+		if (value->type != HALONMTA_HSL_TYPE_ARRAY || index >= value->array.size())
+			return false;
+		*key = value->array[index].first.get();
+		*val = value->array[index].second.get();
+		return true;
+	}
+}
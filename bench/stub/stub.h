@@ -0,0 +1,101 @@
+/*
+ * The opaque HalonMTA types as the stub library defines them, so that
+ * benchmarks and tests can build what the MTA would pass to the plugin, and
+ * counters of the queue policy calls it made.
+ */
+#pragma once
+
+#include <HalonMTA.h>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// a configuration tree, a string, an object or an array
+struct HalonConfig
+{
+	bool isstring = false;
+	std::string string;
+	std::map<std::string, HalonConfig> object;
+	std::vector<HalonConfig> array;
+
+	HalonConfig() = default;
+	HalonConfig(const char* value) : isstring(true), string(value)
+	{
+	}
+	HalonConfig(const std::string& value) : isstring(true), string(value)
+	{
+	}
+};
+
+struct HalonInitContext
+{
+	HalonConfig config;
+};
+
+struct HalonQueueMessage
+{
+	std::string values[HALONMTA_MESSAGE_COUNT];
+};
+
+struct HalonHSLValue
+{
+	int type = HALONMTA_HSL_TYPE_NONE;
+	std::string string;
+	double number = 0;
+	std::vector<std::pair<std::unique_ptr<HalonHSLValue>, std::unique_ptr<HalonHSLValue>>> array;
+};
+
+// a message being queued, set by Halon_queue_insert_callback without allocating
+struct HalonQueueContext
+{
+	HalonQueueMessage* message = nullptr;
+	std::vector<char*> localips;
+	bool localips_set = false;
+	const char* localips_result[64];
+	size_t localips_result_count = 0;
+	HalonHSLValue ret;
+};
+
+struct HalonHSLContext
+{
+	HalonQueueMessage* message = nullptr;
+};
+
+struct HalonHSLArguments
+{
+	std::vector<HalonHSLValue*> values;
+};
+
+struct HalonHSLRegisterContext
+{
+	std::map<std::string, void (*)(HalonHSLContext*, HalonHSLArguments*, HalonHSLValue*)> functions;
+};
+
+namespace stub
+{
+	// calls made by the plugin, may be read while it runs
+	struct Calls
+	{
+		std::atomic<uint64_t> policy_add{ 0 };
+		std::atomic<uint64_t> policy_update{ 0 };
+		std::atomic<uint64_t> policy_delete{ 0 };
+		std::atomic<uint64_t> suspend_add{ 0 };
+		std::atomic<uint64_t> suspend_delete{ 0 };
+	};
+
+	extern Calls calls;
+
+	// when enabled, a line per queue policy call, such as "policy_add p1 192.0.2.1"
+	void record(bool enable);
+	std::vector<std::string> recorded();
+
+	// busy wait in every queue policy call, to simulate the cost of the MTA
+	void latency(uint64_t ns);
+
+	// the entries currently added, by "policy" or "suspend" and id
+	size_t entries(const char* type);
+}
@@ -0,0 +1,158 @@
+/*
+ * End-to-end sync benchmark: the plugin syncs from a local policyd stand-in
+ * into the stub MTA. For each policy count it reports the time to ready, the
+ * apply throughput and the cost of a reconnect and full resync, as a JSON
+ * line. Each count runs in a child process, since the plugin only inits once.
+ * With --zstd the stream is compressed, each frame flushed into a binary
+ * message as policyd would send it.
+ *
+ * usage: sync [--batch n] [--latency ns] [--capture file] [--zstd] [count...]
+ */
+#include "../policyd-client.cpp"
+#include "frames.h"
+#include "policyd.h"
+#include "stub/stub.h"
+#include <sys/wait.h>
+#include <functional>
+
+static double msSince(std::chrono::steady_clock::time_point t)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t).count();
+}
+
+static bool waitFor(const std::function<bool()>& done, int seconds)
+{
+	auto until = std::chrono::steady_clock::now() + std::chrono::seconds(seconds);
+	while (!done())
+	{
+		if (std::chrono::steady_clock::now() > until)
+			return false;
+		usleep(1000);
+	}
+	return true;
+}
+
+// one zstd stream for the connection, flushed at the end of each frame
+static bool compress(Policyd::Connection& connection)
+{
+	ZSTD_CCtx* cctx = ZSTD_createCCtx();
+	if (!cctx)
+		return false;
+	bool ok = true;
+	for (auto& frame : connection.frames)
+	{
+		std::string out;
+		ZSTD_inBuffer in = { frame.payload.data(), frame.payload.size(), 0 };
+		size_t r;
+		do
+		{
+			size_t offset = out.size();
+			out.resize(offset + ZSTD_CStreamOutSize());
+			ZSTD_outBuffer o = { &out[offset], ZSTD_CStreamOutSize(), 0 };
+			r = ZSTD_compressStream2(cctx, &o, &in, ZSTD_e_flush);
+			out.resize(offset + o.pos);
+		} while (!ZSTD_isError(r) && r != 0);
+		if (ZSTD_isError(r))
+		{
+			ok = false;
+			break;
+		}
+		frame = { std::move(out), true };
+	}
+	connection.headers.push_back("X-Policyd-Compression: zstd");
+	ZSTD_freeCCtx(cctx);
+	return ok;
+}
+
+static int run(size_t count, size_t batch, const char* capture, bool zstd)
+{
+	Policyd::Connection connection;
+	for (auto& frame : benchSync(count, batch))
+		connection.frames.push_back({ std::move(frame), false });
+	if (zstd && !compress(connection))
+	{
+		fprintf(stderr, "sync: Failed to compress\n");
+		return 1;
+	}
+	size_t suspends = count / 100;
+	size_t policies = count - suspends;
+
+	Policyd policyd;
+	policyd.script(connection);
+	policyd.script(connection);
+	if (!policyd.start())
+	{
+		fprintf(stderr, "sync: Failed to listen\n");
+		return 1;
+	}
+
+	HalonInitContext hic;
+	hic.config.object["address"] = policyd.address();
+	if (capture)
+		hic.config.object["capture"] = capture;
+	auto start = std::chrono::steady_clock::now();
+	if (!Halon_init(&hic))
+	{
+		fprintf(stderr, "sync: Failed to init\n");
+		return 1;
+	}
+	double ready_ms = msSince(start);
+	double sync_ms = (double)Stats.sync_duration / 1e6;
+	uint64_t added = stub::calls.policy_add;
+
+	// a full resync of unchanged policies, after the connection is lost
+	auto dropped = std::chrono::steady_clock::now();
+	policyd.drop();
+	uint64_t first = Stats.sync_duration;
+	if (!waitFor([first]() { return Stats.frames[(size_t)FrameAction::SYNCED] >= 2 && Stats.sync_duration != first; }, 600))
+	{
+		fprintf(stderr, "sync: Resync did not complete\n");
+		return 1;
+	}
+	double resync_ms = msSince(dropped);
+	double resync_sync_ms = (double)Stats.sync_duration / 1e6;
+	Halon_cleanup();
+
+	bool ok = added == policies && stub::entries("policy") == policies && stub::entries("suspend") == suspends && (!zstd || Stats.bytes_decompressed);
+	printf("{\"bench\":\"sync\",\"policies\":%zu,\"suspends\":%zu,\"batch\":%zu,\"zstd\":%s,\"ready_ms\":%.3f,\"sync_ms\":%.3f,\"apply_per_s\":%.0f,"
+		   "\"resync_ms\":%.3f,\"resync_sync_ms\":%.3f,\"updates_skipped\":%lu,\"policy_add\":%lu,\"policy_update\":%lu,\"ok\":%s}\n",
+		policies, suspends, batch, zstd ? "true" : "false", ready_ms, sync_ms, (double)count / (sync_ms / 1e3), resync_ms, resync_sync_ms,
+		(unsigned long)Stats.updates_skipped.load(), (unsigned long)stub::calls.policy_add.load(), (unsigned long)stub::calls.policy_update.load(), ok ? "true" : "false");
+	fflush(stdout);
+	return ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+	size_t batch = 1;
+	const char* capture = nullptr;
+	bool zstd = false;
+	std::vector<size_t> counts;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+			batch = strtoul(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc)
+			stub::latency(strtoull(argv[++i], nullptr, 10));
+		else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc)
+			capture = argv[++i];
+		else if (strcmp(argv[i], "--zstd") == 0)
+			zstd = true;
+		else
+			counts.push_back(strtoul(argv[i], nullptr, 10));
+	}
+	if (counts.empty())
+		counts = { 1000, 10000, 100000 };
+
+	int status = 0;
+	for (size_t count : counts)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+			_exit(run(count, batch, capture, zstd));
+		int s;
+		if (pid < 0 || waitpid(pid, &s, 0) != pid || !WIFEXITED(s) || WEXITSTATUS(s) != 0)
+			status = 1;
+	}
+	return status;
+}
@@ -0,0 +1,598 @@
+/*
+ * Unit tests of the frame parser (JSON and CBOR), the cache, the prefix trie
+ * and its address parsing, the expiry wheel and the id table. Prints each
+ * failed check and a summary, exits non-zero if any failed.
+ */
+#include "../policyd-client.cpp"
+#include "frames.h"
+#include "stub/stub.h"
+#include <list>
+#include <map>
+#include <set>
+
+static int checks = 0, failures = 0;
+
+static void check(bool ok, const std::string& what)
+{
+	checks++;
+	if (ok)
+		return;
+	failures++;
+	printf("FAILED: %s\n", what.c_str());
+}
+
+static std::string hexdump(const std::string& data)
+{
+	std::string out;
+	char buf[4];
+	for (unsigned char c : data)
+	{
+		snprintf(buf, sizeof(buf), "%02x", c);
+		out += buf;
+	}
+	return out;
+}
+
+// parses a copy, as the parser writes to it
+static bool json(FrameParser& parser, std::string& buffer, const std::string& text)
+{
+	buffer = text;
+	return parser.parseJson(&buffer[0], buffer.size());
+}
+
+static bool cbor(FrameParser& parser, std::string& buffer, const std::string& data)
+{
+	buffer = data;
+	return parser.parseCbor(&buffer[0], buffer.size());
+}
+
+// CBOR encoding helpers
+static std::string head(int major, uint64_t arg)
+{
+	std::string out;
+	if (arg < 24)
+		return std::string(1, (char)(major << 5 | (int)arg));
+	int info = arg < 0x100 ? 24 : arg < 0x10000 ? 25 : arg < 0x100000000ULL ? 26 : 27;
+	out += (char)(major << 5 | info);
+	for (int i = (1 << (info - 24)) - 1; i >= 0; --i)
+		out += (char)(arg >> (i * 8));
+	return out;
+}
+
+static std::string text(const std::string& str)
+{
+	return head(3, str.size()) + str;
+}
+
+static std::string ref(uint64_t index)
+{
+	return head(6, 25) + head(0, index);
+}
+
+static std::string ns(const std::string& value)
+{
+	return head(6, 256) + value;
+}
+
+static void testJson()
+{
+	FrameParser parser;
+	std::string buffer;
+
+	check(json(parser, buffer, " {\"a\" : [1, -2, 1.5, true, false, null, \"s\", {}, []] } \r\n"), "json: whitespace and all types");
+	FrameValue root = parser.root();
+	FrameValue a = root["a"].child();
+	check(a.isUInt() && a.uint() == 1, "json: uint");
+	a = a.next();
+	check(a.isNumeric() && a.number() == -2, "json: int");
+	a = a.next();
+	check(a.isNumeric() && a.number() == 1.5, "json: double");
+	a = a.next();
+	check(a.isBool() && a.boolean(), "json: true");
+	a = a.next();
+	check(a.isBool() && !a.boolean(), "json: false");
+	a = a.next();
+	check(a && !a.isBool() && !a.isNumeric() && !a.isString(), "json: null");
+	a = a.next();
+	check(a.string() == "s", "json: string");
+	a = a.next();
+	check(a.isObject() && !a.child(), "json: empty object");
+	a = a.next();
+	check(a.isArray() && !a.child(), "json: empty array");
+	check(!a.next(), "json: end of array");
+	check(!root["b"] && !root["b"]["c"] && !root["a"]["a"], "json: missing members");
+
+	check(json(parser, buffer, "{\"k\":1,\"k\":2}") && parser.root()["k"].uint() == 2, "json: the last duplicate key wins");
+
+	check(json(parser, buffer, "\"a\\\"\\\\\\/\\b\\f\\n\\r\\tz\"") && parser.root().string() == "a\"\\/\b\f\n\r\tz", "json: escapes");
+	check(json(parser, buffer, "\"\\u0041\\u00e9\\u20AC\\ud83d\\ude00\"") && parser.root().string() == "A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80", "json: unicode escapes");
+	check(json(parser, buffer, "\"\\u0000\"") && parser.root().string() == std::string(1, '\0'), "json: escaped nul");
+	check(json(parser, buffer, "[\"abc\"]") && parser.root().child().string().data() == buffer.data() + 2, "json: strings point into the frame");
+
+	check(json(parser, buffer, "18446744073709551615") && parser.root().isUInt() && parser.root().uint() == UINT64_MAX, "json: largest uint");
+	check(json(parser, buffer, "18446744073709551616") && !parser.root().isUInt() && parser.root().number() == 18446744073709551616.0, "json: uint overflow is a double");
+	check(json(parser, buffer, "-9223372036854775808") && parser.root().number() == -9223372036854775808.0, "json: smallest int");
+	check(json(parser, buffer, "-0") && parser.root().number() == 0, "json: negative zero");
+	check(json(parser, buffer, "1.5e2") && parser.root().number() == 150, "json: exponent");
+	check(json(parser, buffer, "25E-1") && parser.root().number() == 2.5, "json: negative exponent");
+
+	// decodeUInt takes non-negative numbers only
+	check(json(parser, buffer, "[7, 7.9, -1, 1e30, \"7\"]"), "json: numbers to decode");
+	FrameValue n = parser.root().child();
+	check(decodeUInt(n) == 7 && decodeUInt(n.next()) == 7 && decodeUInt(n.next().next()) == 0 && decodeUInt(n.next().next().next()) == 0 && decodeUInt(n.next().next().next().next()) == 0, "json: decodeUInt");
+
+	for (const char* bad : { "", " ", "{", "}", "[1,]", "[,1]", "{\"a\"}", "{\"a\":}", "{\"a\" 1}", "{a:1}", "{\"a\":1,}", "'a'", "tru", "nul", "True",
+			 "01", "1.", ".5", "-", "1e", "1e+", "+1", "0x10", "\"a", "\"\\x\"", "\"\\u12\"", "\"\\u12g4\"", "\"\\ud800\"", "\"\\ud800\\u0041\"", "\"\\udc00\"",
+			 "\"a\nb\"", "\"\t\"", "1 2", "{} x", "[1] // comment", "/* comment */ 1" })
+		check(!json(parser, buffer, bad), std::string("json: rejects ") + bad);
+
+	// nesting up to the limit, and far beyond it without exhausting the stack
+	std::string deep = std::string(FrameParser::maxDepth, '[') + "1" + std::string(FrameParser::maxDepth, ']');
+	check(json(parser, buffer, deep), "json: nested to the limit");
+	check(!json(parser, buffer, "[" + deep + "]"), "json: nested beyond the limit");
+	check(!json(parser, buffer, std::string(100000, '[')), "json: deeply nested");
+	check(!json(parser, buffer, std::string(FrameParser::maxDepth + 2, '[') + std::string(FrameParser::maxDepth + 2, ']')), "json: nested empty arrays beyond the limit");
+
+	// every truncation of a frame fails
+	std::string frame = benchOperation(3);
+	check(json(parser, buffer, frame), "json: a frame");
+	for (size_t i = 0; i < frame.size(); ++i)
+		if (json(parser, buffer, frame.substr(0, i)))
+			check(false, "json: truncated to " + std::to_string(i));
+}
+
+static void testCbor()
+{
+	FrameParser parser;
+	std::string buffer;
+
+	std::string map = head(5, 3) + text("a") + head(0, 1) + text("b") + head(1, 0) + text("c") + head(4, 2) + head(2, 2) + "xy" + head(7, 21);
+	check(cbor(parser, buffer, map), "cbor: map");
+	FrameValue root = parser.root();
+	check(root["a"].isUInt() && root["a"].uint() == 1, "cbor: uint");
+	check(root["b"].number() == -1, "cbor: negative int");
+	check(root["c"].child().string() == "xy" && root["c"].child().next().boolean(), "cbor: byte string and true");
+
+	check(cbor(parser, buffer, head(0, UINT64_MAX)) && parser.root().uint() == UINT64_MAX, "cbor: largest uint");
+	check(cbor(parser, buffer, head(1, INT64_MAX)) && parser.root().number() == (double)INT64_MIN, "cbor: smallest int");
+	check(!cbor(parser, buffer, head(1, (uint64_t)INT64_MAX + 1)), "cbor: rejects int below int64");
+
+	check(cbor(parser, buffer, head(5, 2) + text("k") + head(0, 1) + text("k") + head(0, 2)) && parser.root()["k"].uint() == 2, "cbor: the last duplicate key wins");
+	check(cbor(parser, buffer, head(6, 1) + head(0, 5)) && parser.root().uint() == 5, "cbor: other tags are skipped");
+
+	std::string simple = head(4, 4) + head(7, 20) + head(7, 21) + head(7, 22) + head(7, 23);
+	check(cbor(parser, buffer, simple), "cbor: simple values");
+	FrameValue s = parser.root().child();
+	check(s.isBool() && !s.boolean() && s.next().boolean() && !s.next().next().isBool() && s.next().next().next() && !s.next().next().next().next(), "cbor: false, true, null, undefined");
+
+	// half, single and double precision
+	struct
+	{
+		std::string data;
+		double value;
+	} floats[] = {
+		{ std::string("\xf9\x3c\x00", 3), 1.0 },
+		{ std::string("\xf9\xc0\x00", 3), -2.0 },
+		{ std::string("\xf9\x00\x01", 3), 5.960464477539063e-8 },
+		{ std::string("\xf9\x7b\xff", 3), 65504.0 },
+		{ std::string("\xf9\x7c\x00", 3), INFINITY },
+		{ std::string("\xf9\xfc\x00", 3), -INFINITY },
+		{ std::string("\xfa\x3f\xc0\x00\x00", 5), 1.5 },
+		{ std::string("\xfb\x3f\xf1\x99\x99\x99\x99\x99\x9a", 9), 1.1 },
+	};
+	for (const auto& f : floats)
+		check(cbor(parser, buffer, f.data) && parser.root().number() == f.value, "cbor: float " + hexdump(f.data));
+	check(cbor(parser, buffer, std::string("\xf9\x7e\x00", 3)) && std::isnan(parser.root().number()), "cbor: half nan");
+
+	// indefinite lengths
+	check(cbor(parser, buffer, "\x7f\x62" "ab" "\x61" "c" "\xff") && parser.root().string() == "abc", "cbor: indefinite text");
+	check(cbor(parser, buffer, "\x5f\xff") && parser.root().isString() && parser.root().string().empty(), "cbor: empty indefinite bytes");
+	check(cbor(parser, buffer, "\x9f\x01\x02\xff") && parser.root().child().next().uint() == 2, "cbor: indefinite array");
+	check(cbor(parser, buffer, "\xbf\x61" "a" "\x01\xff") && parser.root()["a"].uint() == 1, "cbor: indefinite map");
+
+	for (const std::string& bad : { std::string(""), std::string("\x1c"), std::string("\x1d"), std::string("\x1e"), std::string("\x1f"), std::string("\x3f"), std::string("\xff"),
+			 std::string("\x01\x01"), std::string("\xa1\x01\x02", 3), std::string("\xa1\xf6\x01"), std::string("\xe0"), std::string("\xf8\x20"), std::string("\xfc"),
+			 std::string("\x7f\x41" "a" "\xff"), std::string("\x7f\x7f\xff\xff"), std::string("\x7f\x61" "a"), std::string("\x9f\x01"), std::string("\xbf\x61" "a" "\xff"),
+			 std::string("\x62" "a"), std::string("\x1b\x01\x02") })
+		check(!cbor(parser, buffer, bad), "cbor: rejects " + hexdump(bad));
+
+	// nesting up to the limit, and far beyond it without exhausting the stack
+	std::string deep;
+	for (int i = 0; i < FrameParser::maxDepth; ++i)
+		deep += head(4, 1);
+	check(cbor(parser, buffer, deep + head(0, 1)), "cbor: nested to the limit");
+	check(!cbor(parser, buffer, head(4, 1) + deep + head(0, 1)), "cbor: nested beyond the limit");
+	check(!cbor(parser, buffer, std::string(100000, '\x81')), "cbor: deeply nested");
+	check(!cbor(parser, buffer, head(6, 1) + deep + head(0, 1)), "cbor: tags count as nesting");
+
+	// every truncation fails
+	for (size_t i = 0; i < map.size(); ++i)
+		if (cbor(parser, buffer, map.substr(0, i)))
+			check(false, "cbor: truncated to " + std::to_string(i));
+}
+
+static void testStringrefs()
+{
+	FrameParser parser;
+	std::string buffer;
+
+	check(cbor(parser, buffer, ns(head(4, 3) + text("abc") + ref(0) + text("ab"))), "stringref: reference");
+	FrameValue a = parser.root().child();
+	check(a.next().string() == "abc" && a.next().next().string() == "ab", "stringref: value of a reference");
+	check(!cbor(parser, buffer, ns(head(4, 2) + text("ab") + ref(0))), "stringref: short strings are not referenced");
+	check(!cbor(parser, buffer, ns(head(4, 2) + text("abc") + ref(1))), "stringref: out of range");
+	check(!cbor(parser, buffer, head(4, 2) + text("abc") + ref(0)), "stringref: outside of a namespace");
+	check(!cbor(parser, buffer, ns(head(4, 2) + text("abc") + head(6, 25) + text("a"))), "stringref: index must be an uint");
+	check(!cbor(parser, buffer, ns(head(4, 2) + "\x7f\x63" "abc" "\xff" + ref(0))), "stringref: indefinite strings are not referenced");
+	check(cbor(parser, buffer, ns(head(5, 2) + text("key") + text("val") + ref(0) + ref(1))) && parser.root()["key"].string() == "val", "stringref: keys and values");
+	check(cbor(parser, buffer, ns(head(4, 2) + head(2, 3) + "xyz" + ref(0))) && parser.root().child().next().string() == "xyz", "stringref: byte strings");
+
+	// a nested namespace starts empty, and its strings are gone after it
+	check(cbor(parser, buffer, ns(head(4, 3) + text("abc") + ns(head(4, 2) + text("def") + ref(0)) + ref(0))), "stringref: nested namespace");
+	a = parser.root().child();
+	check(a.next().child().next().string() == "def" && a.next().next().string() == "abc", "stringref: nested values");
+	check(!cbor(parser, buffer, ns(head(4, 2) + text("abc") + ns(ref(0)))), "stringref: outer strings in a nested namespace");
+	check(!cbor(parser, buffer, ns(head(4, 3) + text("abc") + ns(text("def")) + ref(1))), "stringref: nested strings after the namespace");
+
+	// from index 24 strings must be 4 bytes, from 256 5 bytes
+	std::string strings;
+	for (int i = 0; i < 24; ++i)
+		strings += text("s" + std::string(1, (char)('a' + i % 26)) + std::string(1, (char)('a' + i / 26)));
+	check(cbor(parser, buffer, ns(head(4, 26) + strings + text("xyz") + ref(23))), "stringref: 3 bytes up to index 23");
+	check(!cbor(parser, buffer, ns(head(4, 26) + strings + text("xyz") + ref(24))), "stringref: 3 bytes not at index 24");
+	check(cbor(parser, buffer, ns(head(4, 26) + strings + text("wxyz") + ref(24))), "stringref: 4 bytes at index 24");
+	std::string many;
+	for (int i = 0; i < 256; ++i)
+		many += text(std::to_string(1000 + i));
+	check(!cbor(parser, buffer, ns(head(4, 258) + many + text("abcd") + ref(256))), "stringref: 4 bytes not at index 256");
+	check(cbor(parser, buffer, ns(head(4, 258) + many + text("abcde") + ref(256))) && parser.root().child().string() == "1000", "stringref: 5 bytes at index 256");
+}
+
+static void testDecode()
+{
+	FrameParser parser;
+	PipelineItem item;
+	DecodedItem decoded;
+
+	item.frame = benchOperation(3, "UPDATE", 7);
+	decodeItem(parser, item, decoded);
+	check(decoded.parsed && decoded.count == 1 && !decoded.batch, "decode: a frame");
+	const FrameSpec& frame = decoded.frames[0];
+	check(frame.action == FrameAction::UPDATE && frame.type == FrameType::POLICY && frame.policy.id == benchPolicyId(3), "decode: action and id");
+	check(frame.policy.type == HALONMTA_POLICY_TYPE_WARMUP && frame.policy.fields == (HALONMTA_QUEUE_LOCALIP | HALONMTA_QUEUE_RECIPIENTDOMAIN), "decode: type and fields");
+	check(frame.policy.concurrency == 7 && frame.policy.tokens == 100 && frame.policy.interval == 3600 && frame.policy.connectinterval == 0.5, "decode: limits");
+	check(frame.policy.ratealgorithm == HALONMTA_RATE_ALGORITHM_TOKENBUCKET && frame.policy.hastag && frame.policy.tag == "warmup-day-3", "decode: rate algorithm and tag");
+	check(frame.policy.propv.size() == 2 && strcmp(frame.policy.propv[0], "stage") == 0 && strcmp(frame.policy.propv[1], "3") == 0, "decode: properties");
+	check(frame.policy.values.size() == 1 && frame.policy.values[0] == "hotmail.com", "decode: values");
+
+	// nothing optional is left from the frame before
+	item.frame = "{\"action\":\"CREATE\",\"policy\":{\"id\":\"x\"}}";
+	decodeItem(parser, item, decoded);
+	check(decoded.parsed && decoded.frames[0].policy.id == "x" && !decoded.frames[0].policy.hastag && decoded.frames[0].policy.propv.empty() && decoded.frames[0].policy.concurrency == 0, "decode: reused spec");
+
+	item.frame = benchSync(5, 5)[1];
+	decodeItem(parser, item, decoded);
+	check(decoded.parsed && decoded.batch && decoded.count == 5 && decoded.frames[4].policy.id == benchPolicyId(4), "decode: batch");
+
+	item.frame = "[1]";
+	decodeItem(parser, item, decoded);
+	check(!decoded.parsed, "decode: not an object");
+	item.frame = "";
+	decodeItem(parser, item, decoded);
+	check(!decoded.parsed, "decode: empty");
+	item.frame = ns(head(5, 1) + text("action") + text("SYNCED"));
+	item.binary = true;
+	decodeItem(parser, item, decoded);
+	check(decoded.parsed && decoded.count == 1 && decoded.frames[0].action == FrameAction::SYNCED, "decode: cbor");
+}
+
+// the spec of a frame, as decoded from the stream; its properties point into
+// the frame, which is kept
+static FrameSpec decodeSpec(const std::string& frame)
+{
+	static std::list<PipelineItem> items;
+	FrameParser parser;
+	DecodedItem decoded;
+	items.emplace_back();
+	items.back().frame = frame;
+	decodeItem(parser, items.back(), decoded);
+	return decoded.count ? decoded.frames[0] : FrameSpec();
+}
+
+static void testCache()
+{
+	PolicySpec policy = decodeSpec(benchOperation(3)).policy;
+	policy.stop = true;
+	policy.ttl = 60;
+	std::string out;
+	cachePut(out, policy);
+
+	PolicySpec got;
+	bool live = false;
+	CacheReader in{ out.data(), out.data() + out.size() };
+	check(cacheGet(in, got, live) && in.p == in.end && live, "cache: policy");
+	check(got.id == policy.id && got.type == policy.type && got.fields == policy.fields && got.values == policy.values, "cache: policy condition fields");
+	bool conditions = true;
+	for (size_t i = 0; i < CONDITION_COUNT; ++i)
+		conditions = conditions && got.conditions.isset[i] == policy.conditions.isset[i] && (!got.conditions.isset[i] || got.conditions.values[i] == policy.conditions.values[i]);
+	check(conditions, "cache: policy conditions");
+	check(got.concurrency == policy.concurrency && got.tokens == policy.tokens && got.interval == policy.interval && got.ratealgorithm == policy.ratealgorithm &&
+			  got.connectinterval == policy.connectinterval,
+		"cache: policy limits");
+	check(got.hastag && got.tag == policy.tag && got.propv.size() == 2 && strcmp(got.propv[1], policy.propv[1]) == 0 && got.stop && got.cluster == policy.cluster, "cache: policy tag, properties and flags");
+	check(got.ttl > 59 && got.ttl <= 60, "cache: policy ttl");
+
+	SuspendSpec suspend = decodeSpec(benchOperation(99)).suspend, gotSuspend;
+	std::string suspendOut;
+	cachePut(suspendOut, suspend);
+	in = { suspendOut.data(), suspendOut.data() + suspendOut.size() };
+	check(cacheGet(in, gotSuspend, live) && live && gotSuspend.id == suspend.id && gotSuspend.warmup && gotSuspend.tag == suspend.tag && gotSuspend.ttl == 0, "cache: suspend");
+
+	bool truncated = true;
+	for (size_t size = 0; size < out.size(); ++size)
+	{
+		in = { out.data(), out.data() + size };
+		truncated = truncated && !cacheGet(in, got, live);
+	}
+	check(truncated, "cache: truncated policy");
+	std::string huge = out;
+	uint64_t length = 1ULL << 62;
+	memcpy(&huge[0], &length, sizeof(length));
+	in = { huge.data(), huge.data() + huge.size() };
+	check(!cacheGet(in, got, live), "cache: corrupt id length");
+
+	policy.ttl = 0.001;
+	out.clear();
+	cachePut(out, policy);
+	usleep(2000);
+	in = { out.data(), out.data() + out.size() };
+	check(cacheGet(in, got, live) && !live, "cache: expired");
+
+	// a saved state is applied again, without its expired entries
+	char path[] = "/tmp/policyd-unit-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+	{
+		check(false, "cache: temporary file");
+		return;
+	}
+	close(fd);
+	Config.cache = path;
+	{
+		SyncState state;
+		state.revision = 9;
+		for (size_t i : { 10, 11, 12 })
+		{
+			FrameSpec frame = decodeSpec(benchOperation(i));
+			frame.policy.ttl = i == 12 ? 0.001 : 0;
+			cacheStore(state, { UUIDType::POLICY, frame.policy.id }, frame.policy);
+		}
+		FrameSpec frame = decodeSpec(benchOperation(199));
+		cacheStore(state, { UUIDType::SUSPEND, frame.suspend.id }, frame.suspend);
+		saveCache(state);
+		check(!state.cache_dirty, "cache: saved");
+	}
+	usleep(2000);
+	size_t policies = stub::entries("policy"), suspends = stub::entries("suspend");
+	{
+		SyncState state;
+		check(loadCache(state) && state.revision == 9 && state.cache.size() == 3, "cache: loaded");
+		check(state.cache.count({ UUIDType::POLICY, benchPolicyId(11) }) && !state.cache.count({ UUIDType::POLICY, benchPolicyId(12) }), "cache: expired entry skipped");
+		check(stub::entries("policy") == policies + 2 && stub::entries("suspend") == suspends + 1, "cache: applied");
+		uint32_t h = state.ids.find(benchPolicyId(10));
+		check(h != IdTable::npos && (state.tracked[h].flags & trackLast(UUIDType::POLICY)), "cache: reconciled on the next SYNCED");
+	}
+
+	std::string data;
+	FILE* fp = fopen(path, "r");
+	char buf[4096];
+	size_t r;
+	while (fp && (r = fread(buf, 1, sizeof(buf), fp)) > 0)
+		data.append(buf, r);
+	if (fp)
+		fclose(fp);
+	auto rewrite = [&path](const std::string& content) {
+		FILE* f = fopen(path, "w");
+		if (f)
+		{
+			fwrite(content.data(), 1, content.size(), f);
+			fclose(f);
+		}
+	};
+	rewrite(data.substr(0, data.size() - 3));
+	{
+		SyncState state;
+		check(loadCache(state) && state.revision == 0 && state.cache.size() <= 3, "cache: truncated file is applied but not resumed from");
+	}
+	rewrite("PDC0" + data.substr(4));
+	{
+		SyncState state;
+		check(!loadCache(state) && state.cache.empty(), "cache: bad magic");
+	}
+	rewrite(data.substr(0, 10));
+	{
+		SyncState state;
+		check(!loadCache(state) && state.cache.empty(), "cache: truncated header");
+	}
+	unlink(path);
+	{
+		SyncState state;
+		check(!loadCache(state), "cache: no file");
+	}
+	Config.cache.clear();
+}
+
+static void testAddress()
+{
+	struct
+	{
+		const char* in;
+		const char* out;
+	} good[] = {
+		{ "192.0.2.1", "192.0.2.1" },
+		{ "192.0.2.7/30", "192.0.2.4/30" },
+		{ "192.0.2.1/32", "192.0.2.1" },
+		{ "10.1.2.3/0", "0.0.0.0/0" },
+		{ "2001:DB8::1", "2001:db8::1" },
+		{ "2001:db8::ff/120", "2001:db8::/120" },
+		{ "2001:db8::1/128", "2001:db8::1" },
+		{ "::/0", "::/0" },
+		{ "::ffff:192.0.2.1", "192.0.2.1" },
+	};
+	for (const auto& g : good)
+	{
+		warmupAddress address;
+		int length;
+		bool ok = parseAddress(g.in, address, length);
+		check(ok && formatAddress(address, length) == g.out, std::string("address: ") + g.in + " as " + (ok ? formatAddress(address, length) : "invalid"));
+	}
+	for (const char* bad : { "", "x", "192.0.2.1/33", "192.0.2.1/", "192.0.2.1/a", "192.0.2.1/0032", "192.0.2.1/-1", "2001:db8::/129", "192.0.2", "/24",
+			 "2001:db8::1::1", "ffff:ffff:ffff:ffff:ffff:ffff:255.255.255.255/128x" })
+	{
+		warmupAddress address;
+		int length;
+		check(!parseAddress(bad, address, length), std::string("address: rejects ") + bad);
+	}
+}
+
+// longest prefix match against a linear scan, on random prefixes
+static void testTrie()
+{
+	std::mt19937_64 random(1);
+	for (int round = 0; round < 50; ++round)
+	{
+		struct Prefix
+		{
+			warmupAddress address;
+			int length;
+			bool replaced;
+		};
+		std::vector<Prefix> prefixes;
+		std::vector<warmupPool> pools(1 + random() % 200);
+		warmupTrie trie;
+		for (size_t i = 0; i < pools.size(); ++i)
+		{
+			// few distinct high bits, so that prefixes share paths
+			warmupAddress a;
+			a.hi = random() % 4 == 0 ? 0 : (random() & 0xf000000000000000ULL) | (random() & 0xf);
+			a.lo = random() % 2 ? 0x0000ffff00000000ULL | (random() & 0xff000003) : random();
+			int length = (int)(random() % 129);
+			if (random() % 3 == 0)
+				length = 96 + (int)(random() % 33);
+			a = a.prefix(length);
+			// a prefix inserted again takes the later pool
+			for (auto& p : prefixes)
+				if (p.length == length && p.address.hi == a.hi && p.address.lo == a.lo)
+					p.replaced = true;
+			prefixes.push_back({ a, length, false });
+			trie.insert(a, length, &pools[i]);
+		}
+		bool ok = true;
+		for (int lookup = 0; lookup < 2000 && ok; ++lookup)
+		{
+			warmupAddress a;
+			const auto& near = prefixes[random() % prefixes.size()].address;
+			a.hi = random() % 2 ? near.hi : random();
+			a.lo = random() % 2 ? near.lo | (random() & 0xff) : random();
+			const warmupPool* expect = nullptr;
+			int best = -1;
+			for (size_t i = 0; i < prefixes.size(); ++i)
+			{
+				int length = prefixes[i].length;
+				if (!prefixes[i].replaced && length > best && a.common(prefixes[i].address, length) == length)
+				{
+					best = length;
+					expect = &pools[i];
+				}
+			}
+			ok = trie.find(a) == expect;
+		}
+		check(ok, "trie: round " + std::to_string(round));
+	}
+	warmupTrie empty;
+	check(empty.find(warmupAddress()) == nullptr, "trie: empty");
+}
+
+// due timers against when each is expected, with random ticks and steps
+static void testWheel()
+{
+	std::mt19937_64 random(2);
+	for (int round = 0; round < 10; ++round)
+	{
+		ExpiryWheel wheel;
+		std::multimap<uint32_t, uint32_t> pending; // expected tick to handle
+		uint32_t now = 0, handle = 0;
+		std::vector<ExpiryWheel::Timer> due;
+		bool ok = true;
+		for (int step = 0; step < 500 && ok; ++step)
+		{
+			for (int n = (int)(random() % 4); n; --n)
+			{
+				// mostly soon, sometimes in the past or beyond the 64^4 ticks of the wheel
+				uint32_t delta = random() % 10 == 0 ? (uint32_t)(random() % 40000000) : (uint32_t)(random() % 5000);
+				uint32_t tick = random() % 20 == 0 ? now - std::min(now, delta) : now + delta;
+				wheel.schedule({ handle, tick, UUIDType::POLICY });
+				pending.emplace(std::max(tick, now + 1), handle++);
+			}
+			uint32_t next = wheel.next();
+			ok &= (next == 0) == pending.empty() && (pending.empty() || (next > now && next <= pending.begin()->first));
+
+			now += random() % 16 == 0 ? (uint32_t)(random() % 1000000) : (uint32_t)(random() % 300);
+			due.clear();
+			wheel.advance(now, due);
+			std::set<uint32_t> expect, got;
+			while (!pending.empty() && pending.begin()->first <= now)
+			{
+				expect.insert(pending.begin()->second);
+				pending.erase(pending.begin());
+			}
+			for (const auto& timer : due)
+				got.insert(timer.handle);
+			ok &= got == expect && due.size() == expect.size() && wheel.size() == pending.size();
+		}
+		check(ok, "wheel: round " + std::to_string(round));
+	}
+}
+
+static void testIds()
+{
+	IdTable ids;
+	const std::string uuid = "0123abcd-4567-89ef-0123-456789abcdef";
+	uint32_t h = ids.intern(uuid);
+	check(ids.find(uuid) == h && ids.intern(uuid) == h && ids.name(h) == uuid && ids.size() == 1, "ids: uuid");
+	size_t memory = ids.memory();
+
+	// anything but a canonical lowercase uuid is kept as a string
+	const std::string upper = "0123ABCD-4567-89EF-0123-456789ABCDEF";
+	std::vector<std::string> strings = { upper, "0123abcd-4567-89ef-0123-456789abcdeg", "0123abcd-4567-89ef-0123-456789abcde", "0123abcd-4567-89ef-0123-456789abcdef0",
+		"0123abcd_4567-89ef-0123-456789abcdef", "0123abcd-456789ef-0123-456789abcdef-", "policy-with-a-name-that-is-long-enough-to-be-allocated", "" };
+	std::vector<uint32_t> handles;
+	for (const auto& s : strings)
+		handles.push_back(ids.intern(s));
+	for (size_t i = 0; i < strings.size(); ++i)
+		check(handles[i] != h && ids.find(strings[i]) == handles[i] && ids.name(handles[i]) == strings[i], "ids: string " + strings[i]);
+	check(ids.size() == 1 + strings.size() && ids.memory() > memory, "ids: size and memory");
+
+	// released handles are reused, and find no longer finds them
+	ids.release(handles[6]);
+	check(ids.find(strings[6]) == IdTable::npos && ids.size() == strings.size(), "ids: release");
+	uint32_t again = ids.intern("fedcba98-7654-3210-fedc-ba9876543210");
+	check(again == handles[6] && ids.name(again) == "fedcba98-7654-3210-fedc-ba9876543210", "ids: reused handle");
+	ids.release(h);
+	check(ids.find(uuid) == IdTable::npos && ids.intern(uuid) == h, "ids: uuid released and interned again");
+}
+
+int main()
+{
+	testJson();
+	testCbor();
+	testStringrefs();
+	testDecode();
+	testCache();
+	testAddress();
+	testTrie();
+	testWheel();
+	testIds();
+	printf("%d checks, %d failed\n", checks, failures);
+	return failures ? 1 : 0;
+}
@@ -1,19 +1,127 @@
 #include <HalonMTA.h>
 #include <curl/curl.h>
-#include <json/json.h>
+#include <zstd.h>
 #include <unistd.h>
-#include <set>
+#include <chrono>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
 #include <atomic>
 #include <thread>
 #include <syslog.h>
-#include <list>
+#include <deque>
 #include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <unordered_map>
+#include <string_view>
 #include <cstring>
+#include <strings.h>
+#include <algorithm>
+#include <random>
+#include <cerrno>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <map>
+#include <vector>
 
 static std::atomic<bool> stop(false);
 static std::atomic<bool> ready(false);
 static std::atomic<bool> error(false);
 static std::thread websocketThread;
+static int stop_fd = -1;
+
+// latency histogram with power of two microsecond buckets, lock-free to update
+struct Histogram
+{
+	static const size_t size = 24;
+	std::atomic<uint64_t> count;
+	std::atomic<uint64_t> sum; // ns
+	std::atomic<uint64_t> buckets[size];
+
+	void add(std::chrono::steady_clock::duration d)
+	{
+		uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+		size_t b = 0;
+		for (uint64_t us = ns / 1000; us && b < size - 1; us >>= 1)
+			++b;
+		count.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(ns, std::memory_order_relaxed);
+		buckets[b].fetch_add(1, std::memory_order_relaxed);
+	}
+};
+
+// adds the lifetime of the scope to a histogram
+class HistogramTimer
+{
+  public:
+	HistogramTimer(Histogram& h)
+		: histogram(h)
+		, start(std::chrono::steady_clock::now())
+	{
+	}
+
+	~HistogramTimer()
+	{
+		histogram.add(std::chrono::steady_clock::now() - start);
+	}
+
+  private:
+	Histogram& histogram;
+	std::chrono::steady_clock::time_point start;
+};
+
+// exported by policyd-client_stats(), zero initialized as it is static
+static struct
+{
+	std::atomic<uint64_t> frames[6]; // by FrameAction
+	std::atomic<uint64_t> batches;
+	std::atomic<uint64_t> reconnects;
+	std::atomic<uint64_t> bytes_received;	  // websocket payload
+	std::atomic<uint64_t> bytes_decompressed; // of compressed payload
+	std::atomic<uint64_t> sync_duration;   // ns, of the last SYNCED
+	std::atomic<uint64_t> queue_full;	   // times the receive thread waited for the apply thread
+	std::atomic<uint64_t> queue_max;	   // most frames queued at once
+	std::atomic<uint64_t> capture_dropped; // frames not captured as the writer fell behind
+	std::atomic<uint64_t> decode_threads;  // in the pool decoding frames before SYNCED
+	std::atomic<uint64_t> decode_parallel; // frames decoded by the pool
+	Histogram queue_wait;
+	std::atomic<uint64_t> ids;			// tracked policies and suspends
+	std::atomic<uint64_t> ids_memory;	// bytes used to track them
+	std::atomic<uint64_t> ids_expiring; // timers pending in the expiry wheel
+	std::atomic<uint64_t> expired;		// ids forgotten as their ttl passed
+	std::atomic<uint64_t> updates_applied;
+	std::atomic<uint64_t> updates_skipped;
+	std::atomic<uint64_t> updates_coalesced; // superseded by a later UPDATE or CREATE within the window
+	std::atomic<uint64_t> updates_cancelled; // dropped by a DELETE within the window
+	Histogram parse;
+	Histogram policy_add;
+	Histogram policy_update;
+	Histogram policy_delete;
+	Histogram suspend_add;
+	Histogram suspend_delete;
+	std::atomic<uint64_t> insert_ips_filtered;
+	std::atomic<uint64_t> insert_no_ips;
+	std::atomic<uint64_t> insert_memo_hits;
+	std::atomic<uint64_t> insert_memo_misses;
+	Histogram insert;
+	Histogram ips; // policyd-client_ips()
+} Stats;
+
+static void signalEvent(int fd)
+{
+	if (fd < 0)
+		return;
+	uint64_t one = 1;
+	(void)!write(fd, &one, sizeof(one));
+}
+
+static void requestStop()
+{
+	stop = true;
+	signalEvent(stop_fd);
+}
 
 enum UUIDType
 {
@@ -21,467 +129,3713 @@ enum UUIDType
 	POLICY,
 };
 
-struct warmupItem
+struct warmupItem
+{
+	int fields;
+	std::vector<std::string> values;
+};
+
+// conditions sharing the same fields, indexed by a hash of their values
+struct warmupMask
+{
+	int fields;
+	std::unordered_multimap<size_t, std::vector<std::string>> values;
+};
+
+struct warmupPool
+{
+	std::unordered_map<std::string, warmupItem> items[2]; // by UUIDType, then id
+	std::vector<warmupMask> masks;
+	int fields = 0; // all fields used by its masks
+};
+
+// an ip address or prefix, ipv4 is mapped into ::ffff:0:0/96
+struct warmupAddress
+{
+	uint64_t hi = 0, lo = 0;
+
+	bool bit(int i) const
+	{
+		return i < 64 ? (hi >> (63 - i)) & 1 : (lo >> (127 - i)) & 1;
+	}
+
+	// the first length bits, the rest cleared
+	warmupAddress prefix(int length) const
+	{
+		warmupAddress a = *this;
+		if (length < 64)
+		{
+			a.hi = length ? a.hi & (~0ULL << (64 - length)) : 0;
+			a.lo = 0;
+		}
+		else if (length < 128)
+			a.lo = length > 64 ? a.lo & (~0ULL << (128 - length)) : 0;
+		return a;
+	}
+
+	// number of leading bits shared with o, at most limit
+	int common(const warmupAddress& o, int limit) const
+	{
+		int n;
+		if (hi != o.hi)
+			n = __builtin_clzll(hi ^ o.hi);
+		else if (lo != o.lo)
+			n = 64 + __builtin_clzll(lo ^ o.lo);
+		else
+			n = 128;
+		return n < limit ? n : limit;
+	}
+};
+
+// parse "address" or "address/length", length is 128 for an address
+static bool parseAddress(std::string_view str, warmupAddress& address, int& length)
+{
+	char buf[INET6_ADDRSTRLEN];
+	size_t slash = str.find('/');
+	std::string_view host = str.substr(0, slash);
+	if (host.size() >= sizeof(buf))
+		return false;
+	memcpy(buf, host.data(), host.size());
+	buf[host.size()] = '\0';
+
+	unsigned char bytes[16];
+	int max;
+	if (inet_pton(AF_INET, buf, bytes + 12) == 1)
+	{
+		memset(bytes, 0, 10);
+		bytes[10] = bytes[11] = 0xff;
+		max = 32;
+	}
+	else if (inet_pton(AF_INET6, buf, bytes) == 1)
+		max = 128;
+	else
+		return false;
+
+	length = max;
+	if (slash != std::string_view::npos)
+	{
+		std::string_view bits = str.substr(slash + 1);
+		if (bits.empty() || bits.size() > 3)
+			return false;
+		length = 0;
+		for (char c : bits)
+		{
+			if (c < '0' || c > '9')
+				return false;
+			length = length * 10 + (c - '0');
+		}
+		if (length > max)
+			return false;
+	}
+	length += 128 - max;
+
+	address.hi = address.lo = 0;
+	for (size_t i = 0; i < 8; ++i)
+	{
+		address.hi = address.hi << 8 | bytes[i];
+		address.lo = address.lo << 8 | bytes[i + 8];
+	}
+	address = address.prefix(length);
+	return true;
+}
+
+// the same address or prefix is always written the same way
+static std::string formatAddress(const warmupAddress& address, int length)
+{
+	unsigned char bytes[16];
+	for (size_t i = 0; i < 8; ++i)
+	{
+		bytes[i] = (unsigned char)(address.hi >> (56 - i * 8));
+		bytes[i + 8] = (unsigned char)(address.lo >> (56 - i * 8));
+	}
+	char buf[INET6_ADDRSTRLEN];
+	bool ipv4 = length >= 96 && address.hi == 0 && (address.lo >> 32) == 0xffff;
+	if (ipv4)
+	{
+		inet_ntop(AF_INET, bytes + 12, buf, sizeof(buf));
+		length -= 96;
+		return length == 32 ? buf : std::string(buf) + "/" + std::to_string(length);
+	}
+	inet_ntop(AF_INET6, bytes, buf, sizeof(buf));
+	return length == 128 ? buf : std::string(buf) + "/" + std::to_string(length);
+}
+
+// path compressed binary trie for longest prefix match, of warmup pools or
+// of large prefixes
+template <typename T>
+class addressTrie
+{
+  public:
+	void clear()
+	{
+		nodes.clear();
+	}
+
+	void insert(const warmupAddress& address, int length, const T* pool)
+	{
+		if (nodes.empty())
+			nodes.push_back({});
+		uint32_t n = 0;
+		while (true)
+		{
+			if (nodes[n].length == length)
+			{
+				nodes[n].pool = pool;
+				return;
+			}
+			bool b = address.bit(nodes[n].length);
+			uint32_t c = nodes[n].child[b];
+			if (!c)
+			{
+				nodes[n].child[b] = add(address, length, pool);
+				return;
+			}
+			int common = address.common(nodes[c].address, std::min(length, (int)nodes[c].length));
+			if (common == nodes[c].length)
+			{
+				n = c;
+				continue;
+			}
+			// split the edge to c where address diverges, or ends
+			uint32_t m = add(address, common, common == length ? pool : nullptr);
+			nodes[m].child[nodes[c].address.bit(common)] = c;
+			if (common != length)
+				nodes[m].child[address.bit(common)] = add(address, length, pool);
+			nodes[n].child[b] = m;
+			return;
+		}
+	}
+
+	const T* find(const warmupAddress& address) const
+	{
+		if (nodes.empty())
+			return nullptr;
+		const T* best = nodes[0].pool;
+		uint32_t n = 0;
+		while (nodes[n].length < 128)
+		{
+			uint32_t c = nodes[n].child[address.bit(nodes[n].length)];
+			if (!c || address.common(nodes[c].address, nodes[c].length) < nodes[c].length)
+				break;
+			n = c;
+			if (nodes[n].pool)
+				best = nodes[n].pool;
+		}
+		return best;
+	}
+
+  private:
+	struct Node
+	{
+		warmupAddress address;
+		uint8_t length = 0;
+		const T* pool = nullptr;
+		uint32_t child[2] = { 0, 0 }; // the root is never a child
+	};
+
+	uint32_t add(const warmupAddress& address, int length, const T* pool)
+	{
+		Node node;
+		node.address = address.prefix(length);
+		node.length = (uint8_t)length;
+		node.pool = pool;
+		nodes.push_back(node);
+		return (uint32_t)(nodes.size() - 1);
+	}
+
+	std::vector<Node> nodes;
+};
+
+using warmupTrie = addressTrie<warmupPool>;
+
+struct warmupSnapshot
+{
+	uint64_t generation = 0;
+	int fields = 0; // all fields used by any mask
+	std::map<std::string, std::shared_ptr<const warmupPool>, std::less<>> localips; // by address, prefix or other localip, shared while unchanged
+	warmupTrie prefixes;																// pools of localips that are an address or prefix
+	bool names = false;																	// some localips are not an address or prefix
+	std::map<std::string, size_t> lazy;													// prefixes added to the mta as addresses are seen, by ids with one
+	addressTrie<size_t> lazyPrefixes;													// the same, for a longest prefix match
+};
+
+// fields that can be matched against, in the order values are stored
+static const std::pair<int, int> warmupFields[] = {
+	{ HALONMTA_QUEUE_TRANSPORTID, HALONMTA_MESSAGE_TRANSACTIONID },
+	{ HALONMTA_QUEUE_REMOTEIP, HALONMTA_MESSAGE_REMOTEIP },
+	{ HALONMTA_QUEUE_REMOTEMX, HALONMTA_MESSAGE_REMOTEMX },
+	{ HALONMTA_QUEUE_RECIPIENTDOMAIN, HALONMTA_MESSAGE_RECIPIENTDOMAIN },
+	{ HALONMTA_QUEUE_JOBID, HALONMTA_MESSAGE_JOBID },
+	{ HALONMTA_QUEUE_GROUPING, HALONMTA_MESSAGE_GROUPING },
+	{ HALONMTA_QUEUE_TENANTID, HALONMTA_MESSAGE_TENANTID },
+};
+
+static const size_t warmupFieldsCount = sizeof(warmupFields) / sizeof(warmupFields[0]);
+
+template <typename T>
+static size_t warmupHash(const T* values, size_t count)
+{
+	size_t h = count;
+	for (size_t i = 0; i < count; ++i)
+		h ^= std::hash<std::string_view>()(values[i]) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+	return h;
+}
+
+static bool warmupEqual(const std::vector<std::string>& values, const std::string_view* compare, size_t count)
+{
+	if (values.size() != count)
+		return false;
+	for (size_t i = 0; i < count; ++i)
+		if (values[i] != compare[i])
+			return false;
+	return true;
+}
+
+// the values of fields, from message values by warmupFields index
+static size_t warmupCompare(int fields, const std::string_view* values, std::string_view* compare)
+{
+	size_t count = 0;
+	for (size_t f = 0; f < warmupFieldsCount; ++f)
+		if (fields & warmupFields[f].first)
+			compare[count++] = values[f];
+	return count;
+}
+
+// if any condition of the pool matches the message values
+static bool warmupMatch(const warmupPool& pool, const std::string_view* values)
+{
+	std::string_view compare[warmupFieldsCount];
+	for (const auto& mask : pool.masks)
+	{
+		size_t compare_count = warmupCompare(mask.fields, values, compare);
+		auto range = mask.values.equal_range(warmupHash(compare, compare_count));
+		for (auto v = range.first; v != range.second; ++v)
+			if (warmupEqual(v->second, compare, compare_count))
+				return true;
+	}
+	return false;
+}
+
+// message values of fields, by warmupFields index, pointing into buffers owned by the message
+static void warmupMessageValues(HalonQueueMessage* hqm, int fields, std::string_view* values)
+{
+	for (size_t f = 0; f < warmupFieldsCount; ++f)
+	{
+		if (!(fields & warmupFields[f].first))
+			continue;
+		size_t vl;
+		const char* v;
+		HalonMTA_message_getinfo(hqm, warmupFields[f].second, nullptr, 0, &v, &vl);
+		values[f] = std::string_view(v, vl);
+	}
+}
+
+/*
+ * The published snapshot is only replaced under warmups_lock, after which
+ * warmups_generation tells readers that it was. Each reading thread keeps a
+ * reference to the snapshot it read last, so it only takes the lock, once,
+ * for a new generation, and otherwise reads it after a single atomic load.
+ * A thread that stops reading keeps its last snapshot until it exits.
+ */
+static std::mutex warmups_lock;
+static std::shared_ptr<const warmupSnapshot> warmups = std::make_shared<const warmupSnapshot>();
+static std::atomic<uint64_t> warmups_generation{ 0 };
+static thread_local std::shared_ptr<const warmupSnapshot> warmups_read;
+
+static const warmupSnapshot& warmupsRead()
+{
+	if (!warmups_read || warmups_read->generation != warmups_generation.load(std::memory_order_acquire))
+	{
+		std::lock_guard<std::mutex> guard(warmups_lock);
+		warmups_read = warmups;
+	}
+	return *warmups_read;
+}
+
+// next generation, and the localip of the item of each id, only touched by the apply thread
+static std::shared_ptr<warmupSnapshot> warmups_pending;
+static std::unordered_map<std::string, std::string> warmups_owners[2]; // by UUIDType
+
+static warmupSnapshot& warmupsWrite()
+{
+	if (!warmups_pending)
+	{
+		// the pools are shared, so this copies a pointer per localip
+		warmups_pending = std::make_shared<warmupSnapshot>(*warmups);
+		// these point into the copied snapshot, rebuilt by warmupsPublish()
+		warmups_pending->prefixes.clear();
+		warmups_pending->lazyPrefixes.clear();
+	}
+	return *warmups_pending;
+}
+
+// the pool of a localip in the next generation, to be changed, copied first
+// if a published generation has it too
+static warmupPool& warmupsPool(warmupSnapshot& snapshot, const std::string& localip)
+{
+	auto& pool = snapshot.localips[localip];
+	if (!pool)
+		pool = std::make_shared<const warmupPool>();
+	else if (pool.use_count() > 1)
+		pool = std::make_shared<const warmupPool>(*pool);
+	// only referenced by the next generation, which no other thread reads yet
+	return const_cast<warmupPool&>(*pool);
+}
+
+static void warmupsPublish()
+{
+	if (!warmups_pending)
+		return;
+	warmups_pending->generation++;
+	warmups_pending->fields = 0;
+	warmups_pending->names = false;
+	for (const auto& pool : warmups_pending->localips)
+	{
+		warmups_pending->fields |= pool.second->fields;
+		warmupAddress address;
+		int length;
+		if (!parseAddress(pool.first, address, length))
+		{
+			warmups_pending->names = true;
+			continue;
+		}
+		warmups_pending->prefixes.insert(address, length, pool.second.get());
+	}
+	for (const auto& prefix : warmups_pending->lazy)
+	{
+		warmupAddress address;
+		int length;
+		if (parseAddress(prefix.first, address, length))
+			warmups_pending->lazyPrefixes.insert(address, length, &prefix.second);
+	}
+	std::shared_ptr<const warmupSnapshot> published(std::move(warmups_pending));
+	{
+		std::lock_guard<std::mutex> guard(warmups_lock);
+		warmups.swap(published);
+	}
+	warmups_generation.store(warmups->generation, std::memory_order_release);
+	// the generation before is freed here, unless a reader still has it
+	published.reset();
+}
+
+/*
+ * Memo of insert callback decisions, keyed by the ip pool and the values of
+ * all fields used by warmup conditions. An entry is only valid for the
+ * generation of warmups it was computed from, so publishing a new snapshot
+ * invalidates everything without touching the memo. Each inserting thread
+ * has a memo of its own, so that a lookup never waits on another thread,
+ * and entries are fixed size so that neither a hit nor a miss allocates.
+ * Each slot is overwritten by the next decision that hashes to it, and pools
+ * or values too large for an entry are not memoized.
+ */
+static const size_t memoKeySize = 480;
+
+struct memoEntry
+{
+	uint64_t generation; // the initial, empty, generation is never memoized
+	size_t hash;
+	uint64_t touse; // bit i keeps localips[i]
+	size_t size;
+	char key[memoKeySize]; // the localips and values, each prefixed by its length
+};
+
+static thread_local memoEntry memo[64];
+
+// the key of a decision, false if it does not fit in an entry
+static bool memoKey(char** localips, size_t localips_count, const std::string_view* values, size_t count, char* key, size_t& size)
+{
+	if (localips_count > 64)
+		return false;
+	size = 0;
+	key[size++] = (char)localips_count;
+	auto put = [&](const char* str, size_t length) {
+		if (length > 255 || size + 1 + length > memoKeySize)
+			return false;
+		key[size++] = (char)length;
+		memcpy(key + size, str, length);
+		size += length;
+		return true;
+	};
+	for (size_t i = 0; i < localips_count; ++i)
+		if (!put(localips[i], strlen(localips[i])))
+			return false;
+	for (size_t i = 0; i < count; ++i)
+		if (!put(values[i].data(), values[i].size()))
+			return false;
+	return true;
+}
+
+static memoEntry& memoSlot(size_t hash)
+{
+	return memo[hash % (sizeof(memo) / sizeof(memo[0]))];
+}
+
+static bool memoGet(uint64_t generation, size_t hash, const char* key, size_t size, uint64_t& touse)
+{
+	const auto& entry = memoSlot(hash);
+	if (entry.generation != generation || entry.hash != hash || entry.size != size || memcmp(entry.key, key, size) != 0)
+		return false;
+	touse = entry.touse;
+	return true;
+}
+
+static void memoPut(uint64_t generation, size_t hash, const char* key, size_t size, uint64_t touse)
+{
+	auto& entry = memoSlot(hash);
+	entry.generation = generation;
+	entry.hash = hash;
+	entry.touse = touse;
+	entry.size = size;
+	memcpy(entry.key, key, size);
+}
+
+/*
+ * Addresses in a prefix too large to add to the MTA up front, queued by the
+ * insert callback for the apply thread to add their entries. Each inserting
+ * thread remembers what it queued within a generation, so that an address is
+ * queued about once, and the lock is only tried, so that the callback never
+ * waits; a decision that could not queue is not memoized, and queues again.
+ */
+static struct
+{
+	std::mutex lock;
+	std::vector<warmupAddress> addresses;
+	std::atomic<int> fd{ -1 }; // of the apply thread, signalled when queued to
+} prefixSeen;
+
+static thread_local std::pair<uint64_t, warmupAddress> prefixQueued[64];
+
+static bool prefixQueue(uint64_t generation, const warmupAddress& address)
+{
+	auto& queued = prefixQueued[((address.hi ^ address.lo) * 0x9e3779b97f4a7c15ULL >> 32) % (sizeof(prefixQueued) / sizeof(prefixQueued[0]))];
+	if (queued.first == generation && queued.second.hi == address.hi && queued.second.lo == address.lo)
+		return true;
+	std::unique_lock<std::mutex> guard(prefixSeen.lock, std::try_to_lock);
+	if (!guard.owns_lock())
+		return false;
+	prefixSeen.addresses.push_back(address);
+	guard.unlock();
+	int fd = prefixSeen.fd.load(std::memory_order_acquire);
+	if (fd >= 0)
+		signalEvent(fd);
+	queued = { generation, address };
+	return true;
+}
+
+static struct
+{
+	std::vector<std::string> addresses; // in order of preference
+	long connect_timeout = 5000;		// ms
+	long update_window = 0;				// ms, 0 applies every UPDATE right away
+	std::string cache;
+	std::string capture; // file to record received frames to
+} Config;
+
+struct UUID
+{
+	UUIDType type;
+	std::string id;
+};
+
+struct UUIDCompare
+{
+	bool operator()(const UUID& a, const UUID& b) const
+	{
+		if (a.type != b.type)
+			return a.type < b.type;
+		return a.id < b.id;
+	}
+};
+
+static void cleanupWarmup(UUIDType type, const std::string& id);
+
+// the pool of an ip, by longest prefix match
+static const warmupPool* findWarmup(const warmupSnapshot& snapshot, const char* localip)
+{
+	warmupAddress address;
+	int length;
+	if (parseAddress(localip, address, length))
+	{
+		const warmupPool* pool = snapshot.prefixes.find(address);
+		if (pool || !snapshot.names)
+			return pool;
+	}
+	auto w = snapshot.localips.find(std::string_view(localip));
+	return w != snapshot.localips.end() ? w->second.get() : nullptr;
+}
+
+static void addWarmup(UUIDType type, const std::string& id, const std::string& localip, const warmupItem& item)
+{
+	// an id only has one item, replace it if the localip changed
+	cleanupWarmup(type, id);
+
+	// "192.0.2.1", "192.0.2.0/24" and "2001:db8::/64" are all accepted
+	warmupAddress address;
+	int length;
+	std::string key = parseAddress(localip, address, length) ? formatAddress(address, length) : localip;
+
+	auto& pool = warmupsPool(warmupsWrite(), key);
+	pool.items[type][id] = item;
+	pool.fields |= item.fields;
+	warmups_owners[type][id] = key;
+
+	auto mask = std::find_if(pool.masks.begin(), pool.masks.end(), [&](const warmupMask& m) { return m.fields == item.fields; });
+	if (mask == pool.masks.end())
+		mask = pool.masks.insert(pool.masks.end(), { item.fields, {} });
+	mask->values.emplace(warmupHash(item.values.data(), item.values.size()), item.values);
+}
+
+static void cleanupWarmup(UUIDType type, const std::string& id)
+{
+	// avoid copying the snapshot if there is nothing to remove
+	auto owner = warmups_owners[type].find(id);
+	if (owner == warmups_owners[type].end())
+		return;
+	std::string localip = std::move(owner->second);
+	warmups_owners[type].erase(owner);
+
+	auto& snapshot = warmupsWrite();
+	auto i = snapshot.localips.find(localip);
+	if (i == snapshot.localips.end() || i->second->items[type].find(id) == i->second->items[type].end())
+		return;
+	auto& pool = warmupsPool(snapshot, localip);
+	auto x = pool.items[type].find(id);
+
+	const auto& item = x->second;
+	for (auto m = pool.masks.begin(); m != pool.masks.end(); ++m)
+	{
+		if (m->fields != item.fields)
+			continue;
+		auto range = m->values.equal_range(warmupHash(item.values.data(), item.values.size()));
+		for (auto v = range.first; v != range.second; ++v)
+		{
+			if (v->second == item.values)
+			{
+				m->values.erase(v);
+				break;
+			}
+		}
+		if (m->values.empty())
+			pool.masks.erase(m);
+		break;
+	}
+	pool.items[type].erase(x);
+	pool.fields = 0;
+	for (const auto& m : pool.masks)
+		pool.fields |= m.fields;
+	if (pool.items[UUIDType::SUSPEND].empty() && pool.items[UUIDType::POLICY].empty())
+		snapshot.localips.erase(localip);
+}
+
+// conditions shared by policies ("if") and suspends
+static const struct
+{
+	int field;
+	const char* name;
+	const char* key;
+} conditionFields[] = {
+	{ HALONMTA_QUEUE_TRANSPORTID, "TRANSPORTID", "transportid" },
+	{ HALONMTA_QUEUE_LOCALIP, "LOCALIP", "localip" },
+	{ HALONMTA_QUEUE_REMOTEIP, "REMOTEIP", "remoteip" },
+	{ HALONMTA_QUEUE_REMOTEMX, "REMOTEMX", "remotemx" },
+	{ HALONMTA_QUEUE_RECIPIENTDOMAIN, "RECIPIENTDOMAIN", "recipientdomain" },
+	{ HALONMTA_QUEUE_JOBID, "JOBID", "jobid" },
+	{ HALONMTA_QUEUE_GROUPING, "GROUPING", "grouping" },
+	{ HALONMTA_QUEUE_TENANTID, "TENANTID", "tenantid" },
+};
+
+enum ConditionField
+{
+	TRANSPORTID,
+	LOCALIP,
+	REMOTEIP,
+	REMOTEMX,
+	RECIPIENTDOMAIN,
+	JOBID,
+	GROUPING,
+	TENANTID,
+	CONDITION_COUNT,
+};
+
+struct ConditionSpec
+{
+	bool isset[CONDITION_COUNT];
+	std::string values[CONDITION_COUNT];
+
+	const char* get(ConditionField f) const
+	{
+		return isset[f] ? values[f].c_str() : nullptr;
+	}
+};
+
+struct PolicySpec
+{
+	std::string id;
+	int type;
+	int fields;
+	ConditionSpec conditions;
+	std::vector<std::string> values; // warmup match values, in warmupFields order
+	size_t concurrency;
+	size_t tokens;
+	double interval;
+	int ratealgorithm;
+	double connectinterval;
+	bool hastag;
+	std::string tag;
+	std::vector<std::string> properties;
+	std::vector<const char*> propv;
+	bool stop;
+	bool cluster;
+	double ttl;
+};
+
+struct SuspendSpec
+{
+	std::string id;
+	bool warmup;
+	ConditionSpec conditions;
+	bool hastag;
+	std::string tag;
+	std::vector<std::string> properties;
+	std::vector<const char*> propv;
+	double ttl;
+};
+
+enum class FrameAction
+{
+	UNKNOWN,
+	VERSION,
+	CREATE,
+	UPDATE,
+	DELETE,
+	SYNCED,
+};
+
+enum class FrameType
+{
+	NONE,
+	POLICY,
+	SUSPEND,
+};
+
+// a decoded frame, reused between frames to keep string and vector capacity
+struct FrameSpec
+{
+	FrameAction action;
+	uint64_t version;
+	uint64_t revision;
+	bool delta;
+	FrameType type;
+	PolicySpec policy;
+	SuspendSpec suspend;
+};
+
+/*
+ * Frames are parsed in place. Strings point into the frame itself, which is
+ * rewritten where JSON escapes or CBOR chunked strings need it, and nodes are
+ * kept in an arena that is reused, so that a parse allocates nothing once it
+ * has grown to the largest frame. Node 0 is a null value, returned for
+ * anything that is missing. Children are linked by index, with the key and
+ * value of each object member as two consecutive children.
+ */
+enum class FrameNodeType : uint8_t
+{
+	NUL,
+	BOOL,
+	UINT,
+	INT,
+	DOUBLE,
+	STRING,
+	ARRAY,
+	OBJECT,
+};
+
+struct FrameNode
+{
+	FrameNodeType type;
+	bool boolean;
+	uint32_t size;	// of a string
+	uint32_t first; // child of an array or object
+	uint32_t next;	// sibling
+	union
+	{
+		uint64_t u;
+		int64_t i;
+		double d;
+		const char* str;
+	};
+};
+
+class FrameValue
+{
+  public:
+	FrameValue(const FrameNode* frame_nodes, uint32_t index) : nodes(frame_nodes), n(index)
+	{
+	}
+
+	explicit operator bool() const
+	{
+		return n != 0;
+	}
+
+	bool isObject() const
+	{
+		return node().type == FrameNodeType::OBJECT;
+	}
+	bool isArray() const
+	{
+		return node().type == FrameNodeType::ARRAY;
+	}
+	bool isString() const
+	{
+		return node().type == FrameNodeType::STRING;
+	}
+	bool isBool() const
+	{
+		return node().type == FrameNodeType::BOOL;
+	}
+	bool isNumeric() const
+	{
+		return node().type == FrameNodeType::UINT || node().type == FrameNodeType::INT || node().type == FrameNodeType::DOUBLE;
+	}
+
+	std::string_view string() const
+	{
+		return isString() ? std::string_view(node().str, node().size) : std::string_view();
+	}
+	bool boolean() const
+	{
+		return node().boolean;
+	}
+	double number() const
+	{
+		switch (node().type)
+		{
+			case FrameNodeType::UINT:
+				return (double)node().u;
+			case FrameNodeType::INT:
+				return (double)node().i;
+			case FrameNodeType::DOUBLE:
+				return node().d;
+			default:
+				return 0;
+		}
+	}
+	bool isUInt() const
+	{
+		return node().type == FrameNodeType::UINT;
+	}
+	uint64_t uint() const
+	{
+		return node().u;
+	}
+
+	// the member named key, the last one if repeated
+	FrameValue operator[](const char* key) const
+	{
+		uint32_t found = 0;
+		if (isObject())
+		{
+			size_t length = strlen(key);
+			for (uint32_t k = node().first; k; k = nodes[nodes[k].next].next)
+				if (nodes[k].size == length && memcmp(nodes[k].str, key, length) == 0)
+					found = nodes[k].next;
+		}
+		return FrameValue(nodes, found);
+	}
+
+	// the first element of an array, or key of an object, then the ones after it
+	FrameValue child() const
+	{
+		return FrameValue(nodes, isArray() || isObject() ? node().first : 0);
+	}
+	FrameValue next() const
+	{
+		return FrameValue(nodes, node().next);
+	}
+
+  private:
+	const FrameNode& node() const
+	{
+		return nodes[n];
+	}
+
+	const FrameNode* nodes;
+	uint32_t n;
+};
+
+class FrameParser
+{
+  public:
+	static const int maxDepth = 64;
+
+	bool parseJson(char* data, size_t size)
+	{
+		reset(data, size);
+		uint32_t root;
+		if (!json(root, 0))
+			return false;
+		space();
+		return p == end;
+	}
+
+	/*
+	 * Binary frames of protocol version 2 are CBOR (RFC 8949), parsed into
+	 * the same nodes as text frames. Repeated keys and values may be sent
+	 * once and then referenced by index, using the stringref extension (tags
+	 * 256 and 25, http://cbor.schmorp.de/stringref).
+	 */
+	bool parseCbor(char* data, size_t size)
+	{
+		reset(data, size);
+		stringrefs.clear();
+		namespaces.clear();
+		uint32_t root;
+		return cbor(root, 0) && p == end;
+	}
+
+	FrameValue root() const
+	{
+		return FrameValue(nodes.data(), nodes.size() > 1 ? 1 : 0);
+	}
+
+  private:
+	void reset(char* data, size_t size)
+	{
+		p = data;
+		end = data + size;
+		nodes.resize(1);
+		nodes[0] = {};
+		nodes[0].type = FrameNodeType::NUL;
+	}
+
+	uint32_t add(FrameNodeType type)
+	{
+		nodes.emplace_back();
+		FrameNode& node = nodes.back();
+		node.type = type;
+		node.boolean = false;
+		node.size = node.first = node.next = 0;
+		node.u = 0;
+		return (uint32_t)(nodes.size() - 1);
+	}
+
+	// links a child after the last one of its parent
+	void link(uint32_t parent, uint32_t& last, uint32_t child)
+	{
+		if (last)
+			nodes[last].next = child;
+		else
+			nodes[parent].first = child;
+		last = child;
+	}
+
+	void space()
+	{
+		while (p != end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+			++p;
+	}
+
+	bool literal(const char* word, size_t length)
+	{
+		if ((size_t)(end - p) < length || memcmp(p, word, length) != 0)
+			return false;
+		p += length;
+		return true;
+	}
+
+	bool json(uint32_t& out, int depth)
+	{
+		space();
+		if (p == end || depth > maxDepth)
+			return false;
+		switch (*p)
+		{
+			case '{':
+			{
+				++p;
+				out = add(FrameNodeType::OBJECT);
+				uint32_t last = 0;
+				space();
+				if (p != end && *p == '}')
+				{
+					++p;
+					return true;
+				}
+				while (true)
+				{
+					uint32_t key, value;
+					space();
+					if (p == end || *p != '"' || !jsonString(key))
+						return false;
+					space();
+					if (p == end || *p++ != ':' || !json(value, depth + 1))
+						return false;
+					link(out, last, key);
+					link(out, last, value);
+					space();
+					if (p == end)
+						return false;
+					if (*p == '}')
+					{
+						++p;
+						return true;
+					}
+					if (*p++ != ',')
+						return false;
+				}
+			}
+			case '[':
+			{
+				++p;
+				out = add(FrameNodeType::ARRAY);
+				uint32_t last = 0;
+				space();
+				if (p != end && *p == ']')
+				{
+					++p;
+					return true;
+				}
+				while (true)
+				{
+					uint32_t value;
+					if (!json(value, depth + 1))
+						return false;
+					link(out, last, value);
+					space();
+					if (p == end)
+						return false;
+					if (*p == ']')
+					{
+						++p;
+						return true;
+					}
+					if (*p++ != ',')
+						return false;
+				}
+			}
+			case '"':
+				return jsonString(out);
+			case 't':
+				out = add(FrameNodeType::BOOL);
+				nodes[out].boolean = true;
+				return literal("true", 4);
+			case 'f':
+				out = add(FrameNodeType::BOOL);
+				return literal("false", 5);
+			case 'n':
+				out = add(FrameNodeType::NUL);
+				return literal("null", 4);
+		}
+		return jsonNumber(out);
+	}
+
+	static int hex(char c)
+	{
+		if (c >= '0' && c <= '9')
+			return c - '0';
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		return -1;
+	}
+
+	bool hex4(uint32_t& cp)
+	{
+		if (end - p < 4)
+			return false;
+		cp = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			int h = hex(*p++);
+			if (h < 0)
+				return false;
+			cp = cp << 4 | (uint32_t)h;
+		}
+		return true;
+	}
+
+	// unescapes in place, the result is never longer than the escaped string
+	bool jsonString(uint32_t& out)
+	{
+		char* begin = ++p;
+		while (p != end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20)
+			++p;
+		char* w = p;
+		while (p != end && *p != '"')
+		{
+			if ((unsigned char)*p < 0x20)
+				return false;
+			if (*p != '\\')
+			{
+				*w++ = *p++;
+				continue;
+			}
+			if (++p == end)
+				return false;
+			char c = *p++;
+			switch (c)
+			{
+				case '"':
+				case '\\':
+				case '/':
+					*w++ = c;
+					break;
+				case 'b':
+					*w++ = '\b';
+					break;
+				case 'f':
+					*w++ = '\f';
+					break;
+				case 'n':
+					*w++ = '\n';
+					break;
+				case 'r':
+					*w++ = '\r';
+					break;
+				case 't':
+					*w++ = '\t';
+					break;
+				case 'u':
+				{
+					uint32_t cp;
+					if (!hex4(cp))
+						return false;
+					if (cp >= 0xd800 && cp < 0xdc00)
+					{
+						uint32_t low;
+						if (end - p < 6 || p[0] != '\\' || p[1] != 'u')
+							return false;
+						p += 2;
+						if (!hex4(low) || low < 0xdc00 || low >= 0xe000)
+							return false;
+						cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+					}
+					else if (cp >= 0xdc00 && cp < 0xe000)
+						return false;
+					if (cp < 0x80)
+						*w++ = (char)cp;
+					else if (cp < 0x800)
+					{
+						*w++ = (char)(0xc0 | cp >> 6);
+						*w++ = (char)(0x80 | (cp & 0x3f));
+					}
+					else if (cp < 0x10000)
+					{
+						*w++ = (char)(0xe0 | cp >> 12);
+						*w++ = (char)(0x80 | (cp >> 6 & 0x3f));
+						*w++ = (char)(0x80 | (cp & 0x3f));
+					}
+					else
+					{
+						*w++ = (char)(0xf0 | cp >> 18);
+						*w++ = (char)(0x80 | (cp >> 12 & 0x3f));
+						*w++ = (char)(0x80 | (cp >> 6 & 0x3f));
+						*w++ = (char)(0x80 | (cp & 0x3f));
+					}
+					break;
+				}
+				default:
+					return false;
+			}
+		}
+		if (p == end || (size_t)(w - begin) > UINT32_MAX)
+			return false;
+		++p;
+		out = add(FrameNodeType::STRING);
+		nodes[out].str = begin;
+		nodes[out].size = (uint32_t)(w - begin);
+		return true;
+	}
+
+	bool jsonNumber(uint32_t& out)
+	{
+		const char* begin = p;
+		bool negative = p != end && *p == '-';
+		if (negative)
+			++p;
+		if (p == end || *p < '0' || *p > '9' || (*p == '0' && p + 1 != end && p[1] >= '0' && p[1] <= '9'))
+			return false;
+		uint64_t u = 0;
+		bool overflow = false;
+		while (p != end && *p >= '0' && *p <= '9')
+		{
+			unsigned digit = (unsigned)(*p++ - '0');
+			overflow |= u > (UINT64_MAX - digit) / 10;
+			u = u * 10 + digit;
+		}
+		bool real = false;
+		if (p != end && *p == '.')
+		{
+			real = true;
+			if (++p == end || *p < '0' || *p > '9')
+				return false;
+			while (p != end && *p >= '0' && *p <= '9')
+				++p;
+		}
+		if (p != end && (*p == 'e' || *p == 'E'))
+		{
+			real = true;
+			if (++p != end && (*p == '+' || *p == '-'))
+				++p;
+			if (p == end || *p < '0' || *p > '9')
+				return false;
+			while (p != end && *p >= '0' && *p <= '9')
+				++p;
+		}
+		if (!real && !overflow && !negative)
+		{
+			out = add(FrameNodeType::UINT);
+			nodes[out].u = u;
+			return true;
+		}
+		if (!real && !overflow && u <= (uint64_t)INT64_MAX + 1)
+		{
+			out = add(FrameNodeType::INT);
+			nodes[out].i = u == (uint64_t)INT64_MAX + 1 ? INT64_MIN : -(int64_t)u;
+			return true;
+		}
+		// strtod needs a terminated copy, the number may end the frame
+		char buf[64];
+		size_t length = (size_t)(p - begin);
+		if (length >= sizeof(buf))
+			return false;
+		memcpy(buf, begin, length);
+		buf[length] = '\0';
+		out = add(FrameNodeType::DOUBLE);
+		nodes[out].d = strtod(buf, nullptr);
+		return true;
+	}
+
+	bool cborHead(int& major, int& info, uint64_t& arg)
+	{
+		if (p == end)
+			return false;
+		uint8_t b = (uint8_t)*p++;
+		major = b >> 5;
+		info = b & 0x1f;
+		arg = info;
+		if (info < 24)
+			return true;
+		if (info > 27)
+			return info == 31; // indefinite length or break, 28-30 are reserved
+		size_t n = (size_t)1 << (info - 24);
+		if ((size_t)(end - p) < n)
+			return false;
+		arg = 0;
+		for (size_t i = 0; i < n; ++i)
+			arg = arg << 8 | (uint8_t)*p++;
+		return true;
+	}
+
+	bool cborBreak()
+	{
+		if (p == end || (uint8_t)*p != 0xff)
+			return false;
+		++p;
+		return true;
+	}
+
+	static uint64_t stringrefMin(size_t index)
+	{
+		if (index < 24)
+			return 3;
+		if (index < 256)
+			return 4;
+		if (index < 65536)
+			return 5;
+		if (index < 4294967296ULL)
+			return 7;
+		return 11;
+	}
+
+	bool cborString(int major, int info, uint64_t arg, uint32_t& out)
+	{
+		char* begin = p;
+		size_t length;
+		if (info == 31)
+		{
+			// chunks of definite length, moved together over their heads, and never referenced
+			char* w = p;
+			while (!cborBreak())
+			{
+				int m, i;
+				uint64_t l;
+				if (!cborHead(m, i, l) || m != major || i == 31 || (uint64_t)(end - p) < l)
+					return false;
+				memmove(w, p, l);
+				w += l;
+				p += l;
+			}
+			length = (size_t)(w - begin);
+		}
+		else
+		{
+			if ((uint64_t)(end - p) < arg)
+				return false;
+			length = arg;
+			p += arg;
+			if (!namespaces.empty() && arg >= stringrefMin(stringrefs.size() - namespaces.back()))
+				stringrefs.emplace_back(begin, length);
+		}
+		if (length > UINT32_MAX)
+			return false;
+		out = add(FrameNodeType::STRING);
+		nodes[out].str = begin;
+		nodes[out].size = (uint32_t)length;
+		return true;
+	}
+
+	static double half(uint16_t h)
+	{
+		int exp = (h >> 10) & 0x1f;
+		int mant = h & 0x3ff;
+		double v;
+		if (exp == 0)
+			v = std::ldexp(mant, -24);
+		else if (exp != 31)
+			v = std::ldexp(mant + 1024, exp - 25);
+		else
+			v = mant ? NAN : INFINITY;
+		return h & 0x8000 ? -v : v;
+	}
+
+	bool cbor(uint32_t& out, int depth)
+	{
+		int major, info;
+		uint64_t arg;
+		if (depth > maxDepth || !cborHead(major, info, arg))
+			return false;
+		switch (major)
+		{
+			case 0:
+				out = add(FrameNodeType::UINT);
+				nodes[out].u = arg;
+				return info != 31;
+			case 1:
+				if (info == 31 || arg > (uint64_t)INT64_MAX)
+					return false;
+				out = add(FrameNodeType::INT);
+				nodes[out].i = -1 - (int64_t)arg;
+				return true;
+			case 2:
+			case 3:
+				return cborString(major, info, arg, out);
+			case 4:
+			{
+				out = add(FrameNodeType::ARRAY);
+				uint32_t last = 0;
+				for (uint64_t i = 0; info == 31 ? !cborBreak() : i < arg; ++i)
+				{
+					uint32_t value;
+					if (!cbor(value, depth + 1))
+						return false;
+					link(out, last, value);
+				}
+				return true;
+			}
+			case 5:
+			{
+				out = add(FrameNodeType::OBJECT);
+				uint32_t last = 0;
+				for (uint64_t i = 0; info == 31 ? !cborBreak() : i < arg; ++i)
+				{
+					uint32_t key, value;
+					if (!cbor(key, depth + 1) || nodes[key].type != FrameNodeType::STRING || !cbor(value, depth + 1))
+						return false;
+					link(out, last, key);
+					link(out, last, value);
+				}
+				return true;
+			}
+			case 6:
+				if (arg == 256)
+				{
+					namespaces.push_back(stringrefs.size());
+					bool ok = cbor(out, depth + 1);
+					stringrefs.resize(namespaces.back());
+					namespaces.pop_back();
+					return ok;
+				}
+				if (arg == 25)
+				{
+					int m, i;
+					uint64_t index;
+					if (!cborHead(m, i, index) || m != 0 || i == 31 || namespaces.empty() || index >= stringrefs.size() - namespaces.back())
+						return false;
+					const auto& ref = stringrefs[namespaces.back() + index];
+					out = add(FrameNodeType::STRING);
+					nodes[out].str = ref.first;
+					nodes[out].size = (uint32_t)ref.second;
+					return true;
+				}
+				// other tags only annotate the value
+				return cbor(out, depth + 1);
+			case 7:
+				switch (info)
+				{
+					case 20:
+					case 21:
+						out = add(FrameNodeType::BOOL);
+						nodes[out].boolean = info == 21;
+						return true;
+					case 22:
+					case 23:
+						out = add(FrameNodeType::NUL);
+						return true;
+					case 25:
+						out = add(FrameNodeType::DOUBLE);
+						nodes[out].d = half((uint16_t)arg);
+						return true;
+					case 26:
+					{
+						uint32_t bits = (uint32_t)arg;
+						float f;
+						memcpy(&f, &bits, sizeof(f));
+						out = add(FrameNodeType::DOUBLE);
+						nodes[out].d = (double)f;
+						return true;
+					}
+					case 27:
+					{
+						double d;
+						memcpy(&d, &arg, sizeof(d));
+						out = add(FrameNodeType::DOUBLE);
+						nodes[out].d = d;
+						return true;
+					}
+				}
+				return false;
+		}
+		return false;
+	}
+
+	char* p = nullptr;
+	char* end = nullptr;
+	std::vector<FrameNode> nodes;
+	std::vector<std::pair<const char*, size_t>> stringrefs; // of all namespaces, innermost last
+	std::vector<size_t> namespaces;						  // where each starts in stringrefs
+};
+
+static bool decodeString(FrameValue v, std::string& out)
+{
+	if (!v.isString())
+		return false;
+	std::string_view str = v.string();
+	out.assign(str.data(), str.size());
+	return true;
+}
+
+static bool isString(FrameValue v, const char* str)
+{
+	return v.isString() && v.string() == str;
+}
+
+static uint64_t decodeUInt(FrameValue v)
+{
+	if (v.isUInt())
+		return v.uint();
+	double d = v.number();
+	if (v.isNumeric() && d >= 0 && d < 18446744073709551616.0)
+		return (uint64_t)d;
+	return 0;
+}
+
+static double decodeDouble(FrameValue v)
+{
+	return v.number();
+}
+
+static bool decodeBool(FrameValue v, bool def)
+{
+	return v.isBool() ? v.boolean() : def;
+}
+
+static void decodeConditions(FrameValue v, ConditionSpec& conditions)
+{
+	for (size_t i = 0; i < CONDITION_COUNT; ++i)
+		conditions.isset[i] = decodeString(v[conditionFields[i].key], conditions.values[i]);
+}
+
+static void decodeProperties(FrameValue v, std::vector<std::string>& properties, std::vector<const char*>& propv)
+{
+	propv.clear();
+	if (!v.isObject())
+		return;
+	size_t n = 0;
+	for (FrameValue key = v.child(); key; key = key.next().next())
+	{
+		FrameValue value = key.next();
+		if (!value.isString())
+			continue;
+		if (properties.size() < n + 2)
+			properties.resize(n + 2);
+		std::string_view k = key.string(), s = value.string();
+		properties[n++].assign(k.data(), k.size());
+		properties[n++].assign(s.data(), s.size());
+	}
+	for (size_t i = 0; i < n; ++i)
+		propv.push_back(properties[i].c_str());
+}
+
+static int decodeRateAlgorithm(FrameValue v)
+{
+	if (isString(v, "FIXEDWINDOW"))
+		return HALONMTA_RATE_ALGORITHM_FIXEDWINDOW;
+	if (isString(v, "TOKENBUCKET"))
+		return HALONMTA_RATE_ALGORITHM_TOKENBUCKET;
+	return HALONMTA_RATE_ALGORITHM_DEFAULT;
+}
+
+// the spec is reused between frames, so nothing optional may be left from the last one
+static void decodePolicy(FrameValue v, PolicySpec& policy)
+{
+	policy.id.clear();
+	policy.tag.clear();
+	decodeString(v["id"], policy.id);
+
+	policy.type = HALONMTA_POLICY_TYPE_DYNAMIC;
+	if (isString(v["type"], "WARMUP"))
+		policy.type = HALONMTA_POLICY_TYPE_WARMUP;
+	if (isString(v["type"], "BACKOFF"))
+		policy.type = HALONMTA_POLICY_TYPE_BACKOFF;
+
+	FrameValue if_ = v["if"];
+	decodeConditions(if_, policy.conditions);
+
+	policy.fields = 0;
+	FrameValue fields = v["fields"];
+	if (fields.isArray())
+	{
+		for (FrameValue f = fields.child(); f; f = f.next())
+		{
+			for (const auto& c : conditionFields)
+			{
+				if (isString(f, c.name))
+				{
+					policy.fields |= c.field;
+					break;
+				}
+			}
+		}
+	}
+
+	// LOCALIP is not part of the values
+	policy.values.clear();
+	for (size_t i = 0; i < CONDITION_COUNT; ++i)
+	{
+		if (i == LOCALIP || !(policy.fields & conditionFields[i].field))
+			continue;
+		policy.values.push_back(policy.conditions.isset[i] ? policy.conditions.values[i] : "");
+	}
+
+	FrameValue then = v["then"];
+	policy.concurrency = decodeUInt(then["concurrency"]);
+	policy.tokens = decodeUInt(then["rate"]["count"]);
+	policy.interval = decodeDouble(then["rate"]["interval"]);
+	policy.ratealgorithm = decodeRateAlgorithm(then["rate"]["algorithm"]);
+	policy.connectinterval = decodeDouble(then["connectinterval"]);
+	policy.hastag = decodeString(then["tag"], policy.tag);
+	decodeProperties(then["properties"], policy.properties, policy.propv);
+	policy.stop = decodeBool(then["stop"], false);
+	policy.cluster = decodeBool(then["cluster"], true);
+	policy.ttl = decodeDouble(v["ttl"]);
+}
+
+static void decodeSuspend(FrameValue v, SuspendSpec& suspend)
+{
+	suspend.id.clear();
+	suspend.tag.clear();
+	decodeString(v["id"], suspend.id);
+	suspend.warmup = isString(v["type"], "WARMUP");
+	decodeConditions(v, suspend.conditions);
+	suspend.hastag = decodeString(v["tag"], suspend.tag);
+	decodeProperties(v["properties"], suspend.properties, suspend.propv);
+	suspend.ttl = decodeDouble(v["ttl"]);
+}
+
+// decodes a single operation, either a whole frame or an item of a BATCH frame
+static void decodeFrame(FrameValue root, FrameSpec& frame)
+{
+	frame.action = FrameAction::UNKNOWN;
+	frame.type = FrameType::NONE;
+	if (!root.isObject())
+		return;
+
+	FrameValue action = root["action"];
+	if (isString(action, "VERSION"))
+		frame.action = FrameAction::VERSION;
+	else if (isString(action, "CREATE"))
+		frame.action = FrameAction::CREATE;
+	else if (isString(action, "UPDATE"))
+		frame.action = FrameAction::UPDATE;
+	else if (isString(action, "DELETE"))
+		frame.action = FrameAction::DELETE;
+	else if (isString(action, "SYNCED"))
+		frame.action = FrameAction::SYNCED;
+
+	frame.version = decodeUInt(root["version"]);
+	frame.revision = decodeUInt(root["revision"]);
+	frame.delta = decodeBool(root["delta"], false);
+
+	FrameValue policy = root["policy"];
+	FrameValue suspend = root["suspend"];
+	if (policy.isObject())
+	{
+		frame.type = FrameType::POLICY;
+		decodePolicy(policy, frame.policy);
+	}
+	else if (suspend.isObject())
+	{
+		frame.type = FrameType::SUSPEND;
+		decodeSuspend(suspend, frame.suspend);
+	}
+}
+
+/*
+ * Ids of everything applied are interned, so that sync reconciliation works
+ * on small integer handles. Canonical lowercase uuids, which is what policyd
+ * uses, are stored as 16 bytes, other ids as a string. Released handles are
+ * reused.
+ */
+class IdTable
+{
+  public:
+	static const uint32_t npos = UINT32_MAX;
+
+	uint32_t intern(const std::string& id)
+	{
+		uint32_t h = find(id);
+		if (h != npos)
+			return h;
+		if (!unused.empty())
+		{
+			h = unused.back();
+			unused.pop_back();
+		}
+		else
+		{
+			h = (uint32_t)entries.size();
+			entries.emplace_back();
+		}
+		auto& entry = entries[h];
+		if (parse(id, entry.uuid))
+		{
+			entry.str = nullptr;
+			uuids.emplace(entry.uuid, h);
+		}
+		else
+		{
+			entry.str = &strings.emplace(id, h).first->first;
+			string_bytes += heapSize(*entry.str);
+		}
+		return h;
+	}
+
+	uint32_t find(const std::string& id) const
+	{
+		Uuid uuid;
+		if (parse(id, uuid))
+		{
+			auto i = uuids.find(uuid);
+			return i != uuids.end() ? i->second : npos;
+		}
+		auto i = strings.find(id);
+		return i != strings.end() ? i->second : npos;
+	}
+
+	std::string name(uint32_t h) const
+	{
+		const auto& entry = entries[h];
+		if (entry.str)
+			return *entry.str;
+		static const char hex[] = "0123456789abcdef";
+		std::string id(36, '-');
+		for (size_t i = 0, n = 0; i < id.size(); ++i)
+		{
+			if (i == 8 || i == 13 || i == 18 || i == 23)
+				continue;
+			uint64_t v = n < 16 ? entry.uuid.hi : entry.uuid.lo;
+			id[i] = hex[(v >> (60 - (n % 16) * 4)) & 0xf];
+			++n;
+		}
+		return id;
+	}
+
+	void release(uint32_t h)
+	{
+		auto& entry = entries[h];
+		if (entry.str)
+		{
+			string_bytes -= heapSize(*entry.str);
+			strings.erase(*entry.str);
+			entry.str = nullptr;
+		}
+		else
+			uuids.erase(entry.uuid);
+		unused.push_back(h);
+	}
+
+	size_t size() const
+	{
+		return entries.size() - unused.size();
+	}
+
+	// approximate, hash nodes are counted as their value and two pointers
+	size_t memory() const
+	{
+		return entries.capacity() * sizeof(Entry) + unused.capacity() * sizeof(uint32_t) +
+			   (uuids.bucket_count() + strings.bucket_count()) * sizeof(void*) +
+			   uuids.size() * (sizeof(std::pair<const Uuid, uint32_t>) + 2 * sizeof(void*)) +
+			   strings.size() * (sizeof(std::pair<const std::string, uint32_t>) + 2 * sizeof(void*)) + string_bytes;
+	}
+
+  private:
+	struct Uuid
+	{
+		uint64_t hi, lo;
+		bool operator==(const Uuid& o) const
+		{
+			return hi == o.hi && lo == o.lo;
+		}
+	};
+
+	struct UuidHash
+	{
+		size_t operator()(const Uuid& u) const
+		{
+			return (size_t)(u.hi ^ (u.lo * 0x9e3779b97f4a7c15ULL));
+		}
+	};
+
+	struct Entry
+	{
+		Uuid uuid;
+		const std::string* str; // key in strings, if not a uuid
+	};
+
+	static bool parse(const std::string& id, Uuid& uuid)
+	{
+		if (id.size() != 36)
+			return false;
+		uint64_t v[2] = { 0, 0 };
+		for (size_t i = 0, n = 0; i < id.size(); ++i)
+		{
+			char c = id[i];
+			if (i == 8 || i == 13 || i == 18 || i == 23)
+			{
+				if (c != '-')
+					return false;
+				continue;
+			}
+			uint64_t d;
+			if (c >= '0' && c <= '9')
+				d = (uint64_t)(c - '0');
+			else if (c >= 'a' && c <= 'f')
+				d = (uint64_t)(c - 'a' + 10);
+			else
+				return false;
+			v[n / 16] = v[n / 16] << 4 | d;
+			++n;
+		}
+		uuid = { v[0], v[1] };
+		return true;
+	}
+
+	static size_t heapSize(const std::string& str)
+	{
+		return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+	}
+
+	std::vector<Entry> entries;
+	std::vector<uint32_t> unused;
+	std::unordered_map<Uuid, uint32_t, UuidHash> uuids;
+	std::unordered_map<std::string, uint32_t> strings;
+	size_t string_bytes = 0;
+};
+
+// what is known about an id, by IdTable handle
+struct TrackedId
+{
+	size_t hash = 0;		  // policyHash() of what was applied, 0 if unknown
+	uint32_t expires[2] = {}; // ExpiryWheel tick by UUIDType, 0 if it has no ttl
+	uint8_t flags = 0;		  // trackCurrent() and trackLast() bits
+};
+
+// received on this connection
+static uint8_t trackCurrent(UUIDType type)
+{
+	return (uint8_t)(1 << (type * 2));
+}
+
+// applied before, removed on SYNCED unless received again
+static uint8_t trackLast(UUIDType type)
+{
+	return (uint8_t)(2 << (type * 2));
+}
+
+static const uint8_t trackCurrentMask = 0x5;
+static const uint8_t trackLastMask = 0xa;
+
+/*
+ * Hierarchical timing wheel of ids with a ttl, in ticks of a second. Level n
+ * has 64 slots that are 64^n ticks wide, a slot of a higher level is moved
+ * down when the wheel reaches it, so scheduling and expiring is O(1) no matter
+ * how many ids there are. Timers are not removed when an id is deleted or its
+ * ttl changes, they are checked against TrackedId.expires when they fire.
+ */
+class ExpiryWheel
+{
+  public:
+	struct Timer
+	{
+		uint32_t handle;
+		uint32_t tick;
+		UUIDType type;
+	};
+
+	void schedule(const Timer& timer)
+	{
+		++count;
+		place(timer, current + 1);
+	}
+
+	// move to tick now, appending the timers that are due
+	void advance(uint32_t now, std::vector<Timer>& due)
+	{
+		while (current < now)
+		{
+			if (!count)
+			{
+				current = now;
+				break;
+			}
+			++current;
+			// cascade the higher levels down when the lower level wraps
+			for (size_t level = 1; level < levels && (current & mask(level - 1)) == 0; ++level)
+			{
+				auto& slot = slots[level][(current >> (level * bits)) & (width - 1)];
+				std::vector<Timer> timers;
+				timers.swap(slot);
+				for (const auto& timer : timers)
+					place(timer, current);
+			}
+			auto& slot = slots[0][current & (width - 1)];
+			count -= slot.size();
+			due.insert(due.end(), slot.begin(), slot.end());
+			slot.clear();
+		}
+	}
+
+	// the tick at which advance() next has something to do, 0 if the wheel is empty
+	uint32_t next() const
+	{
+		if (!count)
+			return 0;
+		for (uint32_t tick = current + 1;; ++tick)
+			if ((tick & (width - 1)) == 0 || !slots[0][tick & (width - 1)].empty())
+				return tick;
+	}
+
+	size_t size() const
+	{
+		return count;
+	}
+
+  private:
+	static const size_t bits = 6;
+	static const uint32_t width = 1 << bits;
+	static const size_t levels = 4;
+
+	static uint32_t mask(size_t level)
+	{
+		return (uint32_t)((1ULL << ((level + 1) * bits)) - 1);
+	}
+
+	// in the slot reached no earlier than at tick first, beyond the wheel in its last
+	void place(const Timer& timer, uint32_t first)
+	{
+		uint64_t delta = std::max(timer.tick, first) - current;
+		uint64_t tick = current + std::min<uint64_t>(delta, mask(levels - 1));
+		size_t level = 0;
+		while (level < levels - 1 && delta > mask(level))
+			++level;
+		slots[level][(tick >> (level * bits)) & (width - 1)].push_back(timer);
+	}
+
+	std::vector<Timer> slots[levels][width];
+	uint32_t current = 0;
+	size_t count = 0;
+};
+
+// an UPDATE held back by Config.update_window
+struct PendingUpdate
+{
+	std::chrono::steady_clock::time_point deadline;
+	PolicySpec policy;
+};
+
+struct SyncState
+{
+	IdTable ids;
+	std::vector<TrackedId> tracked; // by id handle
+	uint64_t revision = 0; // last applied revision of a complete state
+	uint64_t version = 0;  // protocol version of this connection
+	bool synced = false;   // SYNCED received on this connection
+	std::chrono::steady_clock::time_point connected;
+	std::map<UUID, std::string, UUIDCompare> cache; // applied specs, if Config.cache is set
+	bool cache_dirty = false;
+	std::chrono::steady_clock::time_point cache_saved;
+	std::unordered_map<std::string, PendingUpdate> updates; // policy id to the latest pending UPDATE
+	std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>> updates_order; // by deadline
+	ExpiryWheel expiry;
+	std::chrono::steady_clock::time_point expiry_start = std::chrono::steady_clock::now(); // tick 0
+};
+
+static uint32_t trackId(SyncState& state, const std::string& id)
+{
+	uint32_t h = state.ids.intern(id);
+	if (h >= state.tracked.size())
+		state.tracked.resize(h + 1);
+	return h;
+}
+
+// forget an id that is no longer tracked
+static void releaseId(SyncState& state, uint32_t h)
+{
+	if (state.tracked[h].flags)
+		return;
+	state.tracked[h] = {};
+	state.ids.release(h);
+}
+
+// no longer received on this connection
+static void untrackId(SyncState& state, UUIDType type, const std::string& id)
+{
+	uint32_t h = state.ids.find(id);
+	if (h == IdTable::npos)
+		return;
+	state.tracked[h].flags &= (uint8_t)~trackCurrent(type);
+	if (type == UUIDType::POLICY)
+		state.tracked[h].hash = 0;
+	releaseId(state, h);
+}
+
+static uint32_t expiryNow(const SyncState& state)
+{
+	return (uint32_t)std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - state.expiry_start).count();
+}
+
+// applied to the MTA with ttl (s), expire it a tick after the MTA does
+static void expireAfter(SyncState& state, UUIDType type, uint32_t h, double ttl)
+{
+	uint32_t tick = 0;
+	if (ttl > 0)
+	{
+		double at = std::chrono::duration<double>(std::chrono::steady_clock::now() - state.expiry_start).count() + ttl;
+		tick = (uint32_t)std::min(std::ceil(at) + 1, (double)UINT32_MAX);
+		state.expiry.schedule({ h, tick, type });
+	}
+	state.tracked[h].expires[type] = tick;
+}
+
+/*
+ * The mta is not known to match the localip condition of a policy or suspend
+ * as a prefix, so one with a prefix is added as an entry per address in it,
+ * named id@address, for its limits to apply to each of them. A prefix of
+ * more than 256 addresses, such as an IPv6 /64, is instead kept with its
+ * spec, and an entry is added for each address the insert callback sees in
+ * it, as prefixMaterialize() takes them from prefixSeen. Only used by the
+ * apply thread.
+ */
+static const size_t prefixMaxAddresses = 256;
+static std::unordered_map<std::string, std::vector<std::string>> prefixEntries[2]; // by UUIDType, id to its entries
+
+template <typename T>
+struct prefixLazy
+{
+	warmupAddress address;
+	int length;
+	std::chrono::steady_clock::time_point applied; // the ttl of the spec is from then
+	T spec;										   // owning its properties
+};
+
+static std::unordered_map<std::string, prefixLazy<PolicySpec>> prefixLazyPolicies;
+static std::unordered_map<std::string, prefixLazy<SuspendSpec>> prefixLazySuspends;
+
+// the length of a localip prefix, 128 for an address or no localip
+static int prefixLength(const ConditionSpec& conditions, warmupAddress& address)
+{
+	int length;
+	if (!conditions.isset[LOCALIP] || !parseAddress(conditions.values[LOCALIP], address, length))
+		return 128;
+	return length;
+}
+
+static bool prefixTooLarge(const ConditionSpec& conditions)
+{
+	warmupAddress address;
+	return ((size_t)1 << std::min(128 - prefixLength(conditions, address), 63)) > prefixMaxAddresses;
+}
+
+// the entries of a localip condition, none for an address or a prefix that is too large
+static void prefixExpand(const ConditionSpec& conditions, std::vector<std::string>& entries)
+{
+	warmupAddress address;
+	int length = prefixLength(conditions, address);
+	if (length == 128 || prefixTooLarge(conditions))
+		return;
+	for (uint64_t i = 0; i < 1ULL << (128 - length); ++i)
+	{
+		warmupAddress a = address;
+		a.lo |= i;
+		entries.push_back(formatAddress(a, 128));
+	}
+}
+
+// the ids with large prefixes are published for the insert callback
+static void prefixLazyPublish(const warmupAddress& address, int length, bool add)
+{
+	auto& snapshot = warmupsWrite();
+	auto i = snapshot.lazy.emplace(formatAddress(address, length), 0).first;
+	if (add)
+		i->second++;
+	else if (--i->second == 0)
+		snapshot.lazy.erase(i);
+}
+
+// keeps a spec with a large prefix, its entries are added as addresses are seen
+template <typename T>
+static void prefixDefer(std::unordered_map<std::string, prefixLazy<T>>& lazy, UUIDType type, const T& spec)
+{
+	auto& l = lazy[spec.id];
+	l.length = prefixLength(spec.conditions, l.address);
+	l.applied = std::chrono::steady_clock::now();
+	l.spec = spec;
+	std::vector<std::string> properties(spec.propv.begin(), spec.propv.end());
+	l.spec.properties = std::move(properties);
+	l.spec.propv.clear();
+	for (const auto& p : l.spec.properties)
+		l.spec.propv.push_back(p.c_str());
+	prefixEntries[type][spec.id].clear();
+	prefixLazyPublish(l.address, l.length, true);
+}
+
+// forgets the entries of an id, deleted or expired in the mta
+static void prefixForget(UUIDType type, const std::string& id)
+{
+	prefixEntries[type].erase(id);
+	auto forget = [&id](auto& lazy) {
+		auto l = lazy.find(id);
+		if (l == lazy.end())
+			return;
+		prefixLazyPublish(l->second.address, l->second.length, false);
+		lazy.erase(l);
+	};
+	if (type == UUIDType::POLICY)
+		forget(prefixLazyPolicies);
+	else
+		forget(prefixLazySuspends);
+}
+
+static bool addPolicy(const std::string& id, const char* localip, PolicySpec& policy)
+{
+	HistogramTimer timer(Stats.policy_add);
+	auto _id = HalonMTA_queue_policy_add6(
+		id.c_str(),										   // const chat* id
+		policy.fields,									   // int fields,
+		policy.type,									   // int type,
+		policy.conditions.get(TRANSPORTID),				   // const char* transportid,
+		localip,										   // const char* localip,
+		policy.conditions.get(REMOTEIP),				   // const char* remoteip,
+		policy.conditions.get(REMOTEMX),				   // const char* remotemx,
+		policy.conditions.get(RECIPIENTDOMAIN),			   // const char* recipientdomain,
+		policy.conditions.get(JOBID),					   // const char* jobid,
+		policy.conditions.get(GROUPING),				   // const char* grouping,
+		policy.conditions.get(TENANTID),				   // const char*tenantidtransportid,
+		policy.concurrency,								   // size_t concurrency,
+		policy.tokens,									   // size_t tokens,
+		policy.interval,								   // double interval,
+		policy.ratealgorithm,							   // int ratealgorithm
+		policy.connectinterval,							   // double connectinterval,
+		policy.hastag ? policy.tag.c_str() : nullptr,	   // const char* tag,
+		policy.propv.size() ? &policy.propv[0] : nullptr, // const char* propv[],
+		policy.propv.size(),							   // size_t propl,
+		policy.stop,									   // bool stop,
+		policy.cluster,									   // bool cluster,
+		policy.ttl										   // double ttl
+	);
+	free(_id);
+	return _id != nullptr;
+}
+
+static bool updatePolicy(const std::string& id, PolicySpec& policy)
+{
+	HistogramTimer timer(Stats.policy_update);
+	return HalonMTA_queue_policy_update4(
+		id.c_str(),
+		policy.concurrency,								   // size_t concurrency,
+		policy.tokens,									   // size_t tokens,
+		policy.interval,								   // double interval,
+		policy.ratealgorithm,							   // int ratealgorithm
+		policy.connectinterval,							   // double connectinterval,
+		policy.hastag ? policy.tag.c_str() : nullptr,	   // const char* tag,
+		policy.propv.size() ? &policy.propv[0] : nullptr, // const char* propv[],
+		policy.propv.size(),							   // size_t propl,
+		policy.stop,									   // bool stop,
+		policy.cluster,									   // bool cluster,
+		policy.ttl										   // double ttl
+	);
+}
+
+static bool deletePolicyEntry(const std::string& id)
+{
+	HistogramTimer timer(Stats.policy_delete);
+	return HalonMTA_queue_policy_delete(id.c_str());
+}
+
+static bool addSuspend(const std::string& id, const char* localip, SuspendSpec& suspend)
+{
+	HistogramTimer timer(Stats.suspend_add);
+	auto _id = HalonMTA_queue_suspend_add5(
+		id.c_str(),
+		suspend.conditions.get(TRANSPORTID),				 // const char* transportid,
+		localip,											 // const char* localip,
+		suspend.conditions.get(REMOTEIP),					 // const char* remoteip,
+		suspend.conditions.get(REMOTEMX),					 // const char* remotemx,
+		suspend.conditions.get(RECIPIENTDOMAIN),			 // const char* recipientdomain,
+		suspend.conditions.get(JOBID),						 // const char* jobid,
+		suspend.conditions.get(GROUPING),					 // const char* grouping,
+		suspend.conditions.get(TENANTID),					 // const char*tenantidtransportid,
+		suspend.hastag ? suspend.tag.c_str() : nullptr,		 // const char* tag,
+		suspend.propv.size() ? &suspend.propv[0] : nullptr, // const char* propv[],
+		suspend.propv.size(),								 // size_t propl,
+		suspend.ttl											 // double ttl
+	);
+	free(_id);
+	return _id != nullptr;
+}
+
+static bool deleteSuspendEntry(const std::string& id)
+{
+	HistogramTimer timer(Stats.suspend_delete);
+	return HalonMTA_queue_suspend_delete(id.c_str());
+}
+
+// deletes the entries of a prefix, or the id itself
+static bool deletePolicy(const std::string& id)
+{
+	auto entries = prefixEntries[UUIDType::POLICY].find(id);
+	if (entries == prefixEntries[UUIDType::POLICY].end())
+		return deletePolicyEntry(id);
+	bool ok = true;
+	for (const auto& address : entries->second)
+		ok = deletePolicyEntry(id + "@" + address) && ok;
+	prefixForget(UUIDType::POLICY, id);
+	return ok;
+}
+
+static bool deleteSuspend(const std::string& id)
+{
+	auto entries = prefixEntries[UUIDType::SUSPEND].find(id);
+	if (entries == prefixEntries[UUIDType::SUSPEND].end())
+		return deleteSuspendEntry(id);
+	bool ok = true;
+	for (const auto& address : entries->second)
+		ok = deleteSuspendEntry(id + "@" + address) && ok;
+	prefixForget(UUIDType::SUSPEND, id);
+	return ok;
+}
+
+// adds an entry per address of a prefix, all or none, or the id itself
+static bool addPolicy(PolicySpec& policy)
+{
+	if (prefixTooLarge(policy.conditions))
+	{
+		prefixDefer(prefixLazyPolicies, UUIDType::POLICY, policy);
+		return true;
+	}
+	std::vector<std::string> entries;
+	prefixExpand(policy.conditions, entries);
+	if (entries.empty())
+		return addPolicy(policy.id, policy.conditions.get(LOCALIP), policy);
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		if (addPolicy(policy.id + "@" + entries[i], entries[i].c_str(), policy))
+			continue;
+		while (i--)
+			deletePolicyEntry(policy.id + "@" + entries[i]);
+		return false;
+	}
+	prefixEntries[UUIDType::POLICY][policy.id] = std::move(entries);
+	return true;
+}
+
+// the "then" part and ttl of a policy, all that an UPDATE carries
+static void policyThen(PolicySpec& policy, const PolicySpec& update)
+{
+	policy.concurrency = update.concurrency;
+	policy.tokens = update.tokens;
+	policy.interval = update.interval;
+	policy.ratealgorithm = update.ratealgorithm;
+	policy.connectinterval = update.connectinterval;
+	policy.hastag = update.hastag;
+	policy.tag = update.tag;
+	policy.properties.assign(update.propv.begin(), update.propv.end());
+	policy.propv.clear();
+	for (const auto& p : policy.properties)
+		policy.propv.push_back(p.c_str());
+	policy.stop = update.stop;
+	policy.cluster = update.cluster;
+	policy.ttl = update.ttl;
+}
+
+static bool updatePolicy(PolicySpec& policy)
+{
+	// entries added from now on get the update too
+	auto lazy = prefixLazyPolicies.find(policy.id);
+	if (lazy != prefixLazyPolicies.end())
+	{
+		policyThen(lazy->second.spec, policy);
+		lazy->second.applied = std::chrono::steady_clock::now();
+	}
+	auto entries = prefixEntries[UUIDType::POLICY].find(policy.id);
+	if (entries == prefixEntries[UUIDType::POLICY].end())
+		return updatePolicy(policy.id, policy);
+	bool ok = true;
+	for (const auto& address : entries->second)
+		ok = updatePolicy(policy.id + "@" + address, policy) && ok;
+	return ok;
+}
+
+static bool addSuspend(SuspendSpec& suspend)
+{
+	if (prefixTooLarge(suspend.conditions))
+	{
+		prefixDefer(prefixLazySuspends, UUIDType::SUSPEND, suspend);
+		return true;
+	}
+	std::vector<std::string> entries;
+	prefixExpand(suspend.conditions, entries);
+	if (entries.empty())
+		return addSuspend(suspend.id, suspend.conditions.get(LOCALIP), suspend);
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		if (addSuspend(suspend.id + "@" + entries[i], entries[i].c_str(), suspend))
+			continue;
+		while (i--)
+			deleteSuspendEntry(suspend.id + "@" + entries[i]);
+		return false;
+	}
+	prefixEntries[UUIDType::SUSPEND][suspend.id] = std::move(entries);
+	return true;
+}
+
+// adds the entries of the large prefixes that contain address, with what is left of their ttl
+template <typename T>
+static void prefixMaterialize(std::unordered_map<std::string, prefixLazy<T>>& lazy, UUIDType type, const warmupAddress& address, const std::string& localip,
+	bool (*add)(const std::string&, const char*, T&))
+{
+	for (auto& l : lazy)
+	{
+		if (address.common(l.second.address, l.second.length) < l.second.length)
+			continue;
+		auto& entries = prefixEntries[type][l.first];
+		if (std::find(entries.begin(), entries.end(), localip) != entries.end())
+			continue;
+		T& spec = l.second.spec;
+		double ttl = spec.ttl;
+		if (ttl > 0)
+		{
+			spec.ttl -= std::chrono::duration<double>(std::chrono::steady_clock::now() - l.second.applied).count();
+			if (spec.ttl <= 0)
+			{
+				spec.ttl = ttl;
+				continue;
+			}
+		}
+		bool ok = add(l.first + "@" + localip, localip.c_str(), spec);
+		spec.ttl = ttl;
+		if (!ok)
+		{
+			syslog(LOG_CRIT, "policyd-client: Failed to add %s@%s", l.first.c_str(), localip.c_str());
+			continue;
+		}
+		entries.push_back(localip);
+	}
+}
+
+static void prefixMaterialize()
+{
+	static std::vector<warmupAddress> addresses;
+	{
+		std::lock_guard<std::mutex> guard(prefixSeen.lock);
+		std::swap(addresses, prefixSeen.addresses);
+	}
+	for (const auto& address : addresses)
+	{
+		std::string localip = formatAddress(address, 128);
+		prefixMaterialize(prefixLazyPolicies, UUIDType::POLICY, address, localip, addPolicy);
+		prefixMaterialize(prefixLazySuspends, UUIDType::SUSPEND, address, localip, addSuspend);
+	}
+	addresses.clear();
+}
+
+// adds the policy to the mta, and to the warmup table if needed
+static bool createPolicy(PolicySpec& policy)
+{
+	if (!addPolicy(policy))
+		return false;
+	if (policy.type == HALONMTA_POLICY_TYPE_WARMUP)
+	{
+		if (policy.conditions.isset[LOCALIP])
+		{
+			addWarmup(UUIDType::POLICY, policy.id, policy.conditions.values[LOCALIP], { policy.fields, policy.values });
+		}
+		else
+		{
+			syslog(LOG_CRIT, "policyd-client: policy of typ warmup was missing localip");
+		}
+	}
+	return true;
+}
+
+static bool createSuspend(SuspendSpec& suspend)
+{
+	if (!addSuspend(suspend))
+		return false;
+	if (suspend.warmup)
+	{
+		if (suspend.conditions.isset[LOCALIP])
+		{
+			addWarmup(UUIDType::SUSPEND, suspend.id, suspend.conditions.values[LOCALIP], { 0, {} });
+		}
+		else
+		{
+			syslog(LOG_CRIT, "policyd-client: policy of typ warmup was missing localip");
+		}
+	}
+	return true;
+}
+
+// hash of what HalonMTA_queue_policy_update4 would change
+static size_t policyHash(const PolicySpec& policy)
+{
+	size_t h = 0;
+	auto combine = [&h](size_t v) { h ^= v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2); };
+	combine(policy.concurrency);
+	combine(policy.tokens);
+	combine(std::hash<double>()(policy.interval));
+	combine((size_t)policy.ratealgorithm);
+	combine(std::hash<double>()(policy.connectinterval));
+	combine(policy.hastag ? std::hash<std::string>()(policy.tag) + 1 : 0);
+	combine(policy.propv.size());
+	for (const auto& p : policy.propv)
+		combine(std::hash<std::string_view>()(p));
+	combine(policy.stop);
+	combine(policy.cluster);
+	combine(std::hash<double>()(policy.ttl));
+	return h;
+}
+
+static bool createPolicy(SyncState& state, uint32_t h, PolicySpec& policy)
+{
+	if (!createPolicy(policy))
+		return false;
+	state.tracked[h].hash = policyHash(policy);
+	expireAfter(state, UUIDType::POLICY, h, policy.ttl);
+	return true;
+}
+
+// update a known policy, unless it is identical to what was last applied, a ttl
+// is relative to when it is applied so a policy with one is always updated
+static bool refreshPolicy(SyncState& state, PolicySpec& policy)
+{
+	size_t hash = policyHash(policy);
+	uint32_t h = state.ids.find(policy.id);
+	TrackedId* tracked = h != IdTable::npos ? &state.tracked[h] : nullptr;
+	if (tracked && tracked->hash == hash && policy.ttl <= 0)
+	{
+		Stats.updates_skipped++;
+		return true;
+	}
+	if (!updatePolicy(policy))
+	{
+		if (tracked)
+			tracked->hash = 0;
+		return false;
+	}
+	if (tracked)
+	{
+		tracked->hash = hash;
+		expireAfter(state, UUIDType::POLICY, h, policy.ttl);
+	}
+	Stats.updates_applied++;
+	return true;
+}
+
+/*
+ * Local cache of the applied state, written after SYNCED and when changes
+ * arrive, so that a restart can apply it without waiting on policyd.
+ * The format is native endian and only meant to be read by the same host:
+ * magic, revision, count, then (type, spec) for each entry. Ttl is stored
+ * as an absolute time so that entries do not outlive their expiry.
+ */
+static const char cacheMagic[4] = { 'P', 'D', 'C', '1' };
+
+static double wallclock()
+{
+	return std::chrono::duration<double>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static void cachePut(std::string& out, uint64_t v)
+{
+	out.append((const char*)&v, sizeof(v));
+}
+
+static void cachePut(std::string& out, double v)
+{
+	out.append((const char*)&v, sizeof(v));
+}
+
+static void cachePut(std::string& out, const std::string& v)
+{
+	cachePut(out, (uint64_t)v.size());
+	out.append(v);
+}
+
+struct CacheReader
+{
+	const char* p;
+	const char* end;
+
+	bool get(uint64_t& v)
+	{
+		if ((size_t)(end - p) < sizeof(v))
+			return false;
+		memcpy(&v, p, sizeof(v));
+		p += sizeof(v);
+		return true;
+	}
+
+	bool get(double& v)
+	{
+		if ((size_t)(end - p) < sizeof(v))
+			return false;
+		memcpy(&v, p, sizeof(v));
+		p += sizeof(v);
+		return true;
+	}
+
+	bool get(std::string& v)
+	{
+		uint64_t l;
+		if (!get(l) || (size_t)(end - p) < l)
+			return false;
+		v.assign(p, l);
+		p += l;
+		return true;
+	}
+};
+
+static void cachePut(std::string& out, const ConditionSpec& conditions)
+{
+	for (size_t i = 0; i < CONDITION_COUNT; ++i)
+	{
+		cachePut(out, (uint64_t)conditions.isset[i]);
+		if (conditions.isset[i])
+			cachePut(out, conditions.values[i]);
+	}
+}
+
+static bool cacheGet(CacheReader& in, ConditionSpec& conditions)
+{
+	for (size_t i = 0; i < CONDITION_COUNT; ++i)
+	{
+		uint64_t isset;
+		if (!in.get(isset))
+			return false;
+		conditions.isset[i] = isset;
+		if (isset && !in.get(conditions.values[i]))
+			return false;
+	}
+	return true;
+}
+
+static void cachePut(std::string& out, const std::vector<const char*>& propv)
+{
+	cachePut(out, (uint64_t)propv.size());
+	for (const auto& p : propv)
+		cachePut(out, std::string(p));
+}
+
+static bool cacheGet(CacheReader& in, std::vector<std::string>& properties, std::vector<const char*>& propv)
+{
+	uint64_t n;
+	if (!in.get(n) || n > (size_t)(in.end - in.p))
+		return false;
+	properties.resize(n);
+	for (auto& p : properties)
+		if (!in.get(p))
+			return false;
+	propv.clear();
+	for (const auto& p : properties)
+		propv.push_back(p.c_str());
+	return true;
+}
+
+static double cacheExpiry(double ttl)
+{
+	return ttl > 0 ? wallclock() + ttl : 0;
+}
+
+// sets the remaining ttl, returns false if already expired
+static bool cacheTTL(double expiry, double& ttl)
+{
+	ttl = 0;
+	if (expiry == 0)
+		return true;
+	ttl = expiry - wallclock();
+	return ttl > 0;
+}
+
+static void cachePut(std::string& out, const PolicySpec& policy)
+{
+	cachePut(out, policy.id);
+	cachePut(out, (uint64_t)policy.type);
+	cachePut(out, (uint64_t)policy.fields);
+	cachePut(out, policy.conditions);
+	cachePut(out, (uint64_t)policy.concurrency);
+	cachePut(out, (uint64_t)policy.tokens);
+	cachePut(out, policy.interval);
+	cachePut(out, (uint64_t)policy.ratealgorithm);
+	cachePut(out, policy.connectinterval);
+	cachePut(out, (uint64_t)policy.hastag);
+	cachePut(out, policy.tag);
+	cachePut(out, policy.propv);
+	cachePut(out, (uint64_t)policy.stop);
+	cachePut(out, (uint64_t)policy.cluster);
+	cachePut(out, cacheExpiry(policy.ttl));
+}
+
+// returns false if the entry is malformed
+static bool cacheGet(CacheReader& in, PolicySpec& policy, bool& live)
+{
+	uint64_t type, fields, concurrency, tokens, ratealgorithm, hastag, stop_, cluster;
+	double expiry;
+	if (!in.get(policy.id) || !in.get(type) || !in.get(fields) || !cacheGet(in, policy.conditions) ||
+		!in.get(concurrency) || !in.get(tokens) || !in.get(policy.interval) || !in.get(ratealgorithm) ||
+		!in.get(policy.connectinterval) || !in.get(hastag) || !in.get(policy.tag) ||
+		!cacheGet(in, policy.properties, policy.propv) || !in.get(stop_) || !in.get(cluster) || !in.get(expiry))
+		return false;
+	policy.type = (int)type;
+	policy.fields = (int)fields;
+	policy.concurrency = concurrency;
+	policy.tokens = tokens;
+	policy.ratealgorithm = (int)ratealgorithm;
+	policy.hastag = hastag;
+	policy.stop = stop_;
+	policy.cluster = cluster;
+	policy.values.clear();
+	for (size_t i = 0; i < CONDITION_COUNT; ++i)
+	{
+		if (i == LOCALIP || !(policy.fields & conditionFields[i].field))
+			continue;
+		policy.values.push_back(policy.conditions.isset[i] ? policy.conditions.values[i] : "");
+	}
+	live = cacheTTL(expiry, policy.ttl);
+	return true;
+}
+
+static void cachePut(std::string& out, const SuspendSpec& suspend)
+{
+	cachePut(out, suspend.id);
+	cachePut(out, (uint64_t)suspend.warmup);
+	cachePut(out, suspend.conditions);
+	cachePut(out, (uint64_t)suspend.hastag);
+	cachePut(out, suspend.tag);
+	cachePut(out, suspend.propv);
+	cachePut(out, cacheExpiry(suspend.ttl));
+}
+
+static bool cacheGet(CacheReader& in, SuspendSpec& suspend, bool& live)
+{
+	uint64_t warmup, hastag;
+	double expiry;
+	if (!in.get(suspend.id) || !in.get(warmup) || !cacheGet(in, suspend.conditions) || !in.get(hastag) ||
+		!in.get(suspend.tag) || !cacheGet(in, suspend.properties, suspend.propv) || !in.get(expiry))
+		return false;
+	suspend.warmup = warmup;
+	suspend.hastag = hastag;
+	live = cacheTTL(expiry, suspend.ttl);
+	return true;
+}
+
+template <typename T>
+static void cacheStore(SyncState& state, const UUID& key, const T& spec)
+{
+	if (Config.cache.empty())
+		return;
+	auto& out = state.cache[key];
+	out.clear();
+	cachePut(out, spec);
+	state.cache_dirty = true;
+}
+
+static void cacheUpdate(SyncState& state, const PolicySpec& update)
+{
+	if (Config.cache.empty())
+		return;
+	auto i = state.cache.find({ UUIDType::POLICY, update.id });
+	if (i == state.cache.end())
+		return;
+
+	PolicySpec policy;
+	bool live;
+	CacheReader in{ i->second.data(), i->second.data() + i->second.size() };
+	if (!cacheGet(in, policy, live))
+		return;
+	policyThen(policy, update);
+	i->second.clear();
+	cachePut(i->second, policy);
+	state.cache_dirty = true;
+}
+
+static void cacheErase(SyncState& state, const UUID& key)
+{
+	if (state.cache.erase(key))
+		state.cache_dirty = true;
+}
+
+static void saveCache(SyncState& state)
+{
+	state.cache_dirty = false;
+	state.cache_saved = std::chrono::steady_clock::now();
+
+	std::string out(cacheMagic, sizeof(cacheMagic));
+	cachePut(out, (uint64_t)state.revision);
+	cachePut(out, (uint64_t)state.cache.size());
+	for (const auto& i : state.cache)
+	{
+		cachePut(out, (uint64_t)i.first.type);
+		out.append(i.second);
+	}
+
+	std::string tmp = Config.cache + ".tmp";
+	FILE* fp = fopen(tmp.c_str(), "w");
+	if (!fp)
+	{
+		syslog(LOG_ERR, "policyd-client: Failed to write cache %s: %s", tmp.c_str(), strerror(errno));
+		return;
+	}
+	bool ok = fwrite(out.data(), 1, out.size(), fp) == out.size();
+	ok = fclose(fp) == 0 && ok;
+	if (!ok || rename(tmp.c_str(), Config.cache.c_str()) != 0)
+	{
+		syslog(LOG_ERR, "policyd-client: Failed to write cache %s: %s", Config.cache.c_str(), strerror(errno));
+		unlink(tmp.c_str());
+	}
+}
+
+// apply a previously saved state, its ids are reconciled on the next SYNCED
+static bool loadCache(SyncState& state)
+{
+	FILE* fp = fopen(Config.cache.c_str(), "r");
+	if (!fp)
+		return false;
+	std::string data;
+	char buf[65536];
+	size_t r;
+	while ((r = fread(buf, 1, sizeof(buf), fp)) > 0)
+		data.append(buf, r);
+	fclose(fp);
+
+	CacheReader in{ data.data(), data.data() + data.size() };
+	uint64_t revision, count;
+	if (data.size() < sizeof(cacheMagic) || memcmp(data.data(), cacheMagic, sizeof(cacheMagic)) != 0)
+	{
+		syslog(LOG_ERR, "policyd-client: Ignoring invalid cache %s", Config.cache.c_str());
+		return false;
+	}
+	in.p += sizeof(cacheMagic);
+	if (!in.get(revision) || !in.get(count))
+	{
+		syslog(LOG_ERR, "policyd-client: Ignoring invalid cache %s", Config.cache.c_str());
+		return false;
+	}
+
+	PolicySpec policy;
+	SuspendSpec suspend;
+	size_t loaded = 0;
+	bool complete = true;
+	for (uint64_t n = 0; n < count; ++n)
+	{
+		uint64_t type;
+		if (!in.get(type))
+		{
+			complete = false;
+			break;
+		}
+		const char* begin = in.p;
+		bool valid = false, live = false, ok = false;
+		UUID key;
+		if (type == UUIDType::POLICY)
+		{
+			valid = cacheGet(in, policy, live);
+			key = { UUIDType::POLICY, policy.id };
+			ok = valid && live && createPolicy(state, trackId(state, policy.id), policy);
+		}
+		else if (type == UUIDType::SUSPEND)
+		{
+			valid = cacheGet(in, suspend, live);
+			key = { UUIDType::SUSPEND, suspend.id };
+			ok = valid && live && createSuspend(suspend);
+		}
+		if (!valid)
+		{
+			complete = false;
+			break;
+		}
+		if (!live)
+			continue;
+		uint32_t h = trackId(state, key.id);
+		if (!ok)
+		{
+			syslog(LOG_CRIT, "policyd-client: Failed to create %s from cache: %s", type == UUIDType::POLICY ? "policy" : "suspend", key.id.c_str());
+			releaseId(state, h);
+			complete = false;
+			continue;
+		}
+		state.tracked[h].flags |= trackLast(key.type);
+		if (key.type == UUIDType::SUSPEND)
+			expireAfter(state, UUIDType::SUSPEND, h, suspend.ttl);
+		state.cache[key].assign(begin, in.p);
+		++loaded;
+	}
+	warmupsPublish();
+
+	// a partially applied cache can not be used to resume from its revision
+	state.revision = complete ? revision : 0;
+	syslog(LOG_INFO, "policyd-client: Loaded %zu entries from cache", loaded);
+	return true;
+}
+
+/*
+ * After SYNCED, UPDATE frames may be held for Config.update_window so that a
+ * storm of updates to the same policy results in a single call to the MTA,
+ * with the latest state, when the window of its first update closes.
+ */
+static void deferUpdate(SyncState& state, PolicySpec& policy)
+{
+	auto i = state.updates.find(policy.id);
+	if (i != state.updates.end())
+	{
+		Stats.updates_coalesced++;
+		std::swap(i->second.policy, policy);
+		return;
+	}
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(Config.update_window);
+	state.updates_order.emplace_back(deadline, policy.id);
+	auto& pending = state.updates[policy.id];
+	pending.deadline = deadline;
+	std::swap(pending.policy, policy);
+}
+
+static bool dropUpdate(SyncState& state, const std::string& id)
+{
+	return state.updates.erase(id) != 0;
+}
+
+// apply pending updates whose window has closed, or all of them
+static void flushUpdates(SyncState& state, bool all)
+{
+	auto now = std::chrono::steady_clock::now();
+	while (!state.updates_order.empty())
+	{
+		const auto& next = state.updates_order.front();
+		if (!all && next.first > now)
+			break;
+		auto i = state.updates.find(next.second);
+		// skip if dropped, or dropped and deferred again with a later deadline
+		if (i != state.updates.end() && i->second.deadline == next.first)
+		{
+			if (!refreshPolicy(state, i->second.policy))
+				syslog(LOG_CRIT, "policyd-client: Failed to update policy: %s", i->first.c_str());
+			else
+				cacheUpdate(state, i->second.policy);
+			state.updates.erase(i);
+		}
+		state.updates_order.pop_front();
+	}
+}
+
+// ms until the next pending update is due, or -1 if none
+static int updatesTimeout(const SyncState& state)
+{
+	if (state.updates_order.empty())
+		return -1;
+	auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(state.updates_order.front().first - std::chrono::steady_clock::now()).count();
+	return wait < 0 ? 0 : (int)wait + 1;
+}
+
+// forget ids whose ttl has passed, the MTA has already expired them by itself
+static void expireIds(SyncState& state)
+{
+	if (!state.expiry.size())
+		return;
+	std::vector<ExpiryWheel::Timer> due;
+	state.expiry.advance(expiryNow(state), due);
+	for (const auto& timer : due)
+	{
+		auto& tracked = state.tracked[timer.handle];
+		uint8_t bits = trackCurrent(timer.type) | trackLast(timer.type);
+		// deleted, or applied again with another ttl since
+		if (tracked.expires[timer.type] != timer.tick || !(tracked.flags & bits))
+			continue;
+		std::string id = state.ids.name(timer.handle);
+		tracked.expires[timer.type] = 0;
+		tracked.flags &= (uint8_t)~bits;
+		if (timer.type == UUIDType::POLICY)
+		{
+			tracked.hash = 0;
+			dropUpdate(state, id);
+		}
+		cacheErase(state, { timer.type, id });
+		cleanupWarmup(timer.type, id);
+		prefixForget(timer.type, id);
+		releaseId(state, timer.handle);
+		Stats.expired++;
+	}
+}
+
+// ms until the next id may expire, or -1 if none
+static int expiryTimeout(const SyncState& state)
+{
+	uint32_t tick = state.expiry.next();
+	if (!tick)
+		return -1;
+	auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(state.expiry_start + std::chrono::seconds(tick) - std::chrono::steady_clock::now()).count();
+	return wait < 0 ? 0 : (int)wait + 1;
+}
+
+// returns false if the connection should be dropped
+static bool applyFrame(FrameSpec& frame, SyncState& state)
+{
+	Stats.frames[(size_t)frame.action]++;
+
+	if (frame.action == FrameAction::VERSION)
+	{
+		// version 2 also allows binary frames
+		if (frame.version != 1 && frame.version != 2)
+		{
+			syslog(LOG_CRIT, "policyd-client: Unsupported version of policyd");
+			error = true;
+			requestStop();
+			return false;
+		}
+		if (frame.delta)
+		{
+			// only changes since our revision follows, everything else is still valid
+			syslog(LOG_INFO, "policyd-client: Resyncing from revision %lu", (unsigned long)state.revision);
+			for (auto& t : state.tracked)
+				t.flags = (uint8_t)((t.flags & trackCurrentMask) | (t.flags & trackLastMask) >> 1);
+		}
+		else
+			state.revision = 0;
+		state.version = frame.version;
+	}
+	if ((frame.action == FrameAction::CREATE || frame.action == FrameAction::UPDATE || frame.action == FrameAction::DELETE) &&
+		((frame.type == FrameType::POLICY && frame.policy.id.empty()) || (frame.type == FrameType::SUSPEND && frame.suspend.id.empty())))
+	{
+		syslog(LOG_CRIT, "policyd-client: Ignoring %s without id", frame.type == FrameType::POLICY ? "policy" : "suspend");
+		if (!ready)
+			return false;
+		return true;
+	}
+	if (frame.action == FrameAction::CREATE)
+	{
+		if (frame.type == FrameType::POLICY)
+		{
+			auto& policy = frame.policy;
+			UUID key{ UUIDType::POLICY, policy.id };
+			if (dropUpdate(state, policy.id))
+				Stats.updates_coalesced++;
+			uint32_t h = trackId(state, policy.id);
+			if (!(state.tracked[h].flags & (trackCurrent(key.type) | trackLast(key.type))))
+			{
+				error = !createPolicy(state, h, policy);
+			}
+			else
+			{
+				error = !refreshPolicy(state, policy);
+			}
+
+			if (error)
+			{
+				syslog(LOG_CRIT, "policyd-client: Failed to create policy: %s", policy.id.c_str());
+				if (!ready)
+				{
+					releaseId(state, h);
+					return false;
+				}
+			}
+			else
+				cacheStore(state, key, policy);
+
+			state.tracked[h].flags |= trackCurrent(key.type);
+		}
+		else if (frame.type == FrameType::SUSPEND)
+		{
+			auto& suspend = frame.suspend;
+			UUID key{ UUIDType::SUSPEND, suspend.id };
+			uint32_t h = trackId(state, suspend.id);
+			if (!(state.tracked[h].flags & (trackCurrent(key.type) | trackLast(key.type))))
+			{
+				error = !createSuspend(suspend);
+				if (!error)
+					expireAfter(state, UUIDType::SUSPEND, h, suspend.ttl);
+			}
+
+			if (error)
+			{
+				syslog(LOG_CRIT, "policyd-client: Failed to create suspend: %s", suspend.id.c_str());
+				if (!ready)
+				{
+					releaseId(state, h);
+					return false;
+				}
+			}
+			else
+				cacheStore(state, key, suspend);
+
+			state.tracked[h].flags |= trackCurrent(key.type);
+		}
+		else
+		{
+			syslog(LOG_CRIT, "policyd-client: Failed to create unsupported type");
+			if (!ready)
+				return false;
+			return true;
+		}
+	}
+	if (frame.action == FrameAction::UPDATE)
+	{
+		if (frame.type != FrameType::POLICY)
+		{
+			syslog(LOG_CRIT, "policyd-client: Failed to update unsupported type");
+			if (!ready)
+				return false;
+			return true;
+		}
+
+		// before SYNCED the state is being rebuilt, nothing is held back
+		if (Config.update_window > 0 && state.synced)
+			deferUpdate(state, frame.policy);
+		else
+		{
+			error = !refreshPolicy(state, frame.policy);
+			if (error)
+			{
+				syslog(LOG_CRIT, "policyd-client: Failed to update policy: %s", frame.policy.id.c_str());
+				if (!ready)
+					return false;
+			}
+			else
+				cacheUpdate(state, frame.policy);
+		}
+	}
+	if (frame.action == FrameAction::DELETE)
+	{
+		if (frame.type == FrameType::POLICY)
+		{
+			const auto& id = frame.policy.id;
+			if (dropUpdate(state, id))
+				Stats.updates_cancelled++;
+			error = !deletePolicy(id);
+			if (error)
+			{
+				syslog(LOG_CRIT, "policyd-client: Failed to delete policy: %s", id.c_str());
+				if (!ready)
+					return false;
+			}
+			untrackId(state, UUIDType::POLICY, id);
+			cacheErase(state, { UUIDType::POLICY, id });
+			cleanupWarmup(UUIDType::POLICY, id);
+		}
+		else if (frame.type == FrameType::SUSPEND)
+		{
+			const auto& id = frame.suspend.id;
+			error = !deleteSuspend(id);
+			if (error)
+			{
+				syslog(LOG_CRIT, "policyd-client: Failed to delete suspend: %s", id.c_str());
+				// if (!ready)
+				//   break;
+			}
+			untrackId(state, UUIDType::SUSPEND, id);
+			cacheErase(state, { UUIDType::SUSPEND, id });
+			cleanupWarmup(UUIDType::SUSPEND, id);
+		}
+		else
+		{
+			syslog(LOG_CRIT, "policyd-client: Failed to delete unsupported type");
+			if (!ready)
+				return false;
+		}
+	}
+	if (frame.action == FrameAction::SYNCED)
+	{
+		// one pass over all ids, removing what was not received again
+		for (uint32_t h = 0; h < state.tracked.size(); ++h)
+		{
+			auto& tracked = state.tracked[h];
+			if (!(tracked.flags & trackLastMask))
+				continue;
+			for (UUIDType type : { UUIDType::SUSPEND, UUIDType::POLICY })
+			{
+				if (!(tracked.flags & trackLast(type)) || (tracked.flags & trackCurrent(type)))
+					continue;
+				std::string id = state.ids.name(h);
+				cacheErase(state, { type, id });
+				switch (type)
+				{
+					case UUIDType::POLICY:
+					{
+						tracked.hash = 0;
+						bool ret = deletePolicy(id);
+						if (!ret)
+							syslog(LOG_CRIT, "policyd-client: Failed to delete policy: %s", id.c_str());
+						cleanupWarmup(UUIDType::POLICY, id);
+					}
+					break;
+					case UUIDType::SUSPEND:
+					{
+						bool ret = deleteSuspend(id);
+						if (!ret)
+							syslog(LOG_CRIT, "policyd-client: Failed to delete suspend: %s", id.c_str());
+						cleanupWarmup(UUIDType::SUSPEND, id);
+					}
+					break;
+				}
+			}
+			tracked.flags &= trackCurrentMask;
+			releaseId(state, h);
+		}
+		warmupsPublish();
+
+		if (error)
+			return false;
+
+		Stats.sync_duration = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - state.connected).count();
+		syslog(LOG_INFO, "policyd-client: Synced (%lu policy updates applied, %lu skipped as unchanged)", (unsigned long)Stats.updates_applied.load(), (unsigned long)Stats.updates_skipped.load());
+		state.synced = true;
+		ready = true;
+	}
+
+	// a revision is only trusted once the state it describes is complete
+	if (frame.revision && state.synced)
+		state.revision = frame.revision;
+
+	if (frame.action == FrameAction::SYNCED && !Config.cache.empty())
+		saveCache(state);
+	return true;
+}
+
+// wait until fd is signaled or timeout (ms) expires
+static void waitEvent(int fd, int timeout)
+{
+	if (fd < 0)
+	{
+		usleep((useconds_t)(timeout < 0 || timeout > 10 ? 10 : timeout) * 1000);
+		return;
+	}
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	int r;
+	while ((r = poll(&pfd, 1, timeout)) < 0 && errno == EINTR)
+		;
+	uint64_t value;
+	if (r > 0)
+		(void)!read(fd, &value, sizeof(value));
+}
+
+// bounded single producer, single consumer queue
+template <typename T>
+class SPSCQueue
+{
+  public:
+	explicit SPSCQueue(size_t capacity)
+		: slots(capacity + 1)
+	{
+	}
+
+	bool push(T& item)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		size_t next = (t + 1) % slots.size();
+		if (next == head.load(std::memory_order_acquire))
+			return false;
+		slots[t] = std::move(item);
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// the next item without removing it, or nullptr if empty
+	T* front()
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return nullptr;
+		return &slots[h];
+	}
+
+	bool pop(T& item)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		item = std::move(slots[h]);
+		head.store((h + 1) % slots.size(), std::memory_order_release);
+		return true;
+	}
+
+	size_t size() const
+	{
+		size_t h = head.load(std::memory_order_acquire);
+		size_t t = tail.load(std::memory_order_acquire);
+		return (t + slots.size() - h) % slots.size();
+	}
+
+  private:
+	std::vector<T> slots;
+	alignas(64) std::atomic<size_t> head{ 0 };
+	alignas(64) std::atomic<size_t> tail{ 0 };
+};
+
+enum class PipelineEvent
+{
+	FRAME,
+	CONNECTED,
+	DISCONNECTED,
+	QUIT,
+};
+
+struct PipelineItem
+{
+	PipelineEvent event;
+	std::string frame;
+	bool binary = false;
+};
+
+/*
+ * With Config.capture set, everything the receive thread queues is also
+ * recorded to a file, which bench/replay feeds through the same pipeline
+ * again to reproduce a sync offline. The format is native endian like the
+ * cache: magic, then (ns since the capture started, event, binary, frame)
+ * for each event. A thread of its own writes the file, and frames are
+ * dropped rather than waited for if it falls too far behind.
+ */
+static const char captureMagic[4] = { 'P', 'D', 'F', '1' };
+
+class CaptureWriter
+{
+  public:
+	~CaptureWriter()
+	{
+		if (!fp)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_one();
+		writer.join();
+		fclose(fp);
+	}
+
+	bool open(const std::string& file)
+	{
+		fp = fopen(file.c_str(), "w");
+		if (!fp)
+		{
+			syslog(LOG_ERR, "policyd-client: Failed to write capture %s: %s", file.c_str(), strerror(errno));
+			return false;
+		}
+		path = file;
+		pending.assign(captureMagic, sizeof(captureMagic));
+		start = std::chrono::steady_clock::now();
+		writer = std::thread([this] { work(); });
+		return true;
+	}
+
+	void add(const PipelineItem& item)
+	{
+		uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		std::lock_guard<std::mutex> lock(mutex);
+		// events other than frames are always kept, so that a replay connects and disconnects
+		if (item.event == PipelineEvent::FRAME && pending.size() + item.frame.size() > backlog)
+		{
+			Stats.capture_dropped++;
+			return;
+		}
+		cachePut(pending, ns);
+		cachePut(pending, (uint64_t)item.event);
+		cachePut(pending, (uint64_t)item.binary);
+		cachePut(pending, item.frame);
+		wake.notify_one();
+	}
+
+  private:
+	static const size_t backlog = 64 << 20;
+
+	void work()
+	{
+		std::string out;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			wake.wait(lock, [this] { return quit || !pending.empty(); });
+			if (pending.empty())
+				return;
+			out.clear();
+			out.swap(pending);
+			lock.unlock();
+			if (!failed && (fwrite(out.data(), 1, out.size(), fp) != out.size() || fflush(fp) != 0))
+			{
+				syslog(LOG_ERR, "policyd-client: Failed to write capture %s: %s", path.c_str(), strerror(errno));
+				failed = true;
+			}
+			lock.lock();
+		}
+	}
+
+	FILE* fp = nullptr;
+	std::string path;
+	std::chrono::steady_clock::time_point start;
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::string pending;
+	bool quit = false;
+	bool failed = false;
+};
+
+/*
+ * The receive thread only reads frames from the websocket and queues them,
+ * the apply thread parses and applies them in order, so the socket is
+ * drained while the MTA is slow to apply. SyncState is owned by the apply
+ * thread, the receive thread only reads it after a DISCONNECTED has been
+ * acknowledged.
+ */
+struct Pipeline
 {
-	int fields;
-	std::vector<std::string> values;
-	std::string id;
-	UUIDType type;
+	SPSCQueue<PipelineItem> queue{ 1024 };
+	int apply_fd = -1;	 // wakes the apply thread
+	int receive_fd = -1; // wakes the receive thread
+	std::atomic<bool> apply_waiting{ false };
+	std::atomic<bool> receive_waiting{ false };
+	std::atomic<bool> drop{ false };			// the apply thread wants the connection dropped
+	std::atomic<uint64_t> disconnected{ 0 }; // DISCONNECTED events applied
+	CaptureWriter* capture = nullptr;
 };
 
-static std::mutex warmups_mutex;
-static std::map<std::string, std::list<warmupItem>> warmups;
-
-static struct
+static void pipelinePush(Pipeline& pipeline, PipelineItem& item)
 {
-	std::string address;
-} Config;
+	if (pipeline.capture && item.event != PipelineEvent::QUIT)
+		pipeline.capture->add(item);
+	if (!pipeline.queue.push(item))
+	{
+		// backpressure, wait for the apply thread to catch up
+		Stats.queue_full++;
+		HistogramTimer timer(Stats.queue_wait);
+		while (true)
+		{
+			pipeline.receive_waiting = true;
+			if (pipeline.queue.push(item))
+				break;
+			waitEvent(pipeline.receive_fd, -1);
+		}
+		pipeline.receive_waiting = false;
+	}
+	size_t size = pipeline.queue.size();
+	if (size > Stats.queue_max)
+		Stats.queue_max = size;
+	if (pipeline.apply_waiting.exchange(false))
+		signalEvent(pipeline.apply_fd);
+}
 
-struct UUID
+// a queued frame parsed and decoded, ready to be applied
+struct DecodedItem
 {
-	UUIDType type;
-	std::string id;
+	bool parsed = false;
+	bool batch = false;
+	size_t count = 0;			   // frames in use
+	std::vector<FrameSpec> frames; // one, or the operations of a BATCH, reused
 };
 
-struct UUIDCompare
+// parses the frame in place, it is not used again after this
+static void decodeItem(FrameParser& parser, PipelineItem& item, DecodedItem& decoded)
 {
-	bool operator()(const UUID& a, const UUID& b) const
+	decoded.batch = false;
+	decoded.count = 0;
+
 	{
-		if (a.type != b.type)
-			return a.type < b.type;
-		return a.id < b.id;
+		HistogramTimer timer(Stats.parse);
+		if (item.binary)
+			decoded.parsed = parser.parseCbor(&item.frame[0], item.frame.size());
+		else
+			decoded.parsed = parser.parseJson(&item.frame[0], item.frame.size());
+	}
+	FrameValue value = parser.root();
+	if (!decoded.parsed || !value.isObject())
+	{
+		decoded.parsed = false;
+		return;
+	}
+
+	auto next = [&decoded]() -> FrameSpec& {
+		if (decoded.frames.size() <= decoded.count)
+			decoded.frames.emplace_back();
+		return decoded.frames[decoded.count++];
+	};
+	if (isString(value["action"], "BATCH"))
+	{
+		decoded.batch = true;
+		FrameValue operations = value["operations"];
+		if (operations.isArray())
+			for (FrameValue operation = operations.child(); operation; operation = operation.next())
+				decodeFrame(operation, next());
+	}
+	else
+		decodeFrame(value, next());
+}
+
+// returns false if the connection should be dropped
+static bool applyItem(const PipelineItem& item, DecodedItem& decoded, SyncState& state)
+{
+	if (item.binary && state.version < 2)
+	{
+		syslog(LOG_CRIT, "policyd-client: Binary frame before version 2");
+		return true;
+	}
+	if (!decoded.parsed)
+	{
+		syslog(LOG_CRIT, "policyd-client: Failed to parse frame");
+		return true;
+	}
+
+	// many operations in one frame, applied in order
+	if (decoded.batch)
+		Stats.batches++;
+	for (size_t i = 0; i < decoded.count; ++i)
+		if (!applyFrame(decoded.frames[i], state))
+			return false;
+	return true;
+}
+
+/*
+ * During the initial sync (and after each reconnect) the server sends the
+ * whole rule set as fast as it can, and parsing it on the apply thread alone
+ * is what holds up SYNCED. Until then the apply thread takes all frames that
+ * are queued and lets this pool parse and decode them (helping out itself),
+ * and then applies them in order as usual. The MTA queue functions are still
+ * only called from the apply thread.
+ */
+class DecodePool
+{
+  public:
+	explicit DecodePool(size_t threads)
+	{
+		for (size_t i = 0; i < threads; ++i)
+			workers.emplace_back([this] { work(); });
+	}
+
+	~DecodePool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (auto& worker : workers)
+			worker.join();
+	}
+
+	size_t size() const
+	{
+		return workers.size();
+	}
+
+	void run(FrameParser& parser, PipelineItem* items, DecodedItem* decoded, size_t count)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job.items = items;
+			job.decoded = decoded;
+			job.count = count;
+			job.next = 0;
+			++generation;
+		}
+		wake.notify_all();
+		size_t helped = drain(parser, job);
+
+		// workers may still be decoding the last items they took
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this] { return active == 0; });
+		job.count = 0;
+		Stats.decode_parallel += count - helped;
+	}
+
+  private:
+	struct Job
+	{
+		PipelineItem* items = nullptr;
+		DecodedItem* decoded = nullptr;
+		size_t count = 0;
+		std::atomic<size_t> next{ 0 };
+	};
+
+	static size_t drain(FrameParser& parser, Job& job)
+	{
+		size_t n = 0, i;
+		while ((i = job.next.fetch_add(1, std::memory_order_relaxed)) < job.count)
+		{
+			decodeItem(parser, job.items[i], job.decoded[i]);
+			++n;
+		}
+		return n;
+	}
+
+	void work()
+	{
+		FrameParser parser;
+		uint64_t seen = 0;
+		while (true)
+		{
+			{
+				// only join a job that is running, run() does not return until
+				// every worker that joined has left it again
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return quit || (generation != seen && job.count); });
+				if (quit)
+					return;
+				seen = generation;
+				++active;
+			}
+			drain(parser, job);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				--active;
+			}
+			done.notify_one();
+		}
 	}
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	Job job;
+	uint64_t generation = 0;
+	size_t active = 0;
+	bool quit = false;
 };
 
-static void cleanupWarmup(UUIDType type, const std::string& id)
+static void applyWorker(SyncState& state, Pipeline& pipeline)
 {
-	std::lock_guard<std::mutex> lck(warmups_mutex);
-	for (auto i = warmups.begin(); i != warmups.end(); ++i)
+	FrameParser parser;
+	PipelineItem item;
+	DecodedItem decoded;
+	bool dropping = false;
+
+	// the apply thread decodes too, so one less than there are cores
+	unsigned int cores = std::thread::hardware_concurrency();
+	DecodePool pool(std::min(cores > 1 ? cores - 1 : 0, 7u));
+	Stats.decode_threads = pool.size();
+	std::vector<PipelineItem> batch(pool.size() ? 256 : 0);
+	std::vector<DecodedItem> batch_decoded(batch.size());
+	prefixSeen.fd.store(pipeline.apply_fd, std::memory_order_release);
+
+	while (true)
 	{
-		for (auto x = i->second.begin(); x != i->second.end(); ++x)
+		if (!pipeline.queue.pop(item))
 		{
-			if (x->type == type && x->id == id)
+			// queue drained, make all changes so far visible in one swap
+			flushUpdates(state, false);
+			expireIds(state);
+			prefixMaterialize();
+			warmupsPublish();
+			Stats.ids = state.ids.size();
+			Stats.ids_memory = state.ids.memory() + state.tracked.capacity() * sizeof(TrackedId);
+			Stats.ids_expiring = state.expiry.size();
+
+			// write the cache at most every 10s while changes arrive, it must not
+			// get ahead of pending updates as it is saved with the latest revision
+			int timeout = updatesTimeout(state);
+			int expiry = expiryTimeout(state);
+			if (expiry >= 0 && (timeout < 0 || expiry < timeout))
+				timeout = expiry;
+			if (state.cache_dirty && state.synced)
+			{
+				auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(state.cache_saved + std::chrono::seconds(10) - std::chrono::steady_clock::now()).count();
+				if (wait <= 0)
+				{
+					flushUpdates(state, true);
+					saveCache(state);
+					// nothing is pending after the flush, but ids may still expire
+					timeout = expiryTimeout(state);
+				}
+				else if (timeout < 0 || wait < timeout)
+					timeout = (int)wait;
+			}
+
+			pipeline.apply_waiting = true;
+			if (!pipeline.queue.pop(item))
 			{
-				i->second.erase(x);
-				if (i->second.empty())
-					warmups.erase(i);
+				waitEvent(pipeline.apply_fd, timeout);
+				pipeline.apply_waiting = false;
+				continue;
+			}
+			pipeline.apply_waiting = false;
+		}
+		if (pipeline.receive_waiting.exchange(false))
+			signalEvent(pipeline.receive_fd);
+		if (!state.updates_order.empty())
+			flushUpdates(state, false);
+		expireIds(state);
+
+		switch (item.event)
+		{
+			case PipelineEvent::CONNECTED:
+				error = false;
+				dropping = false;
+				state.synced = false;
+				state.version = 0;
+				state.connected = std::chrono::steady_clock::now();
+				break;
+			case PipelineEvent::DISCONNECTED:
+				flushUpdates(state, true);
+				warmupsPublish();
+				if (state.cache_dirty && state.synced)
+					saveCache(state);
+
+				// saving old rules...
+				for (auto& t : state.tracked)
+					t.flags = (uint8_t)((t.flags & trackLastMask) | (t.flags & trackCurrentMask) << 1);
+
+				pipeline.drop = false;
+				pipeline.disconnected.fetch_add(1, std::memory_order_release);
+				signalEvent(pipeline.receive_fd);
+				break;
+			case PipelineEvent::QUIT:
+				prefixSeen.fd.store(-1, std::memory_order_release);
 				return;
+			case PipelineEvent::FRAME:
+			{
+				// the rest of a failed connection is not applied
+				if (dropping || stop)
+					break;
+
+				bool ok = true;
+				if (!state.synced && pipeline.queue.front() && pool.size())
+				{
+					// take the frames queued behind this one and decode them all at once,
+					// frames after SYNCED are decoded here too which does no harm
+					size_t count = 0;
+					batch[count++] = std::move(item);
+					PipelineItem* next;
+					while (count < batch.size() && (next = pipeline.queue.front()) && next->event == PipelineEvent::FRAME)
+						pipeline.queue.pop(batch[count++]);
+					if (pipeline.receive_waiting.exchange(false))
+						signalEvent(pipeline.receive_fd);
+
+					pool.run(parser, batch.data(), batch_decoded.data(), count);
+					for (size_t i = 0; i < count && ok; ++i)
+						ok = applyItem(batch[i], batch_decoded[i], state);
+				}
+				else
+				{
+					decodeItem(parser, item, decoded);
+					ok = applyItem(item, decoded, state);
+				}
+				if (!ok)
+				{
+					dropping = true;
+					pipeline.drop = true;
+					signalEvent(pipeline.receive_fd);
+				}
 			}
+			break;
+		}
+	}
+}
+
+// wait until the socket is readable, the apply thread signals or timeout (ms) expires, returns false if stopping
+static bool waitSocket(curl_socket_t sockfd, int wake_fd, int timeout)
+{
+	if ((stop_fd < 0 || wake_fd < 0) && timeout < 0)
+		timeout = 100;
+	struct pollfd fds[3] = { { stop_fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 }, { sockfd, POLLIN, 0 } };
+	int r;
+	while (!stop && (r = poll(fds, 3, timeout)) < 0 && errno == EINTR)
+		;
+	uint64_t value;
+	if (fds[1].revents & POLLIN)
+		(void)!read(wake_fd, &value, sizeof(value));
+	return !stop;
+}
+
+/*
+ * If policyd answers the upgrade with "X-Policyd-Compression: zstd", the
+ * payload of every websocket message is the next part of a single zstd
+ * stream that stays open for the whole connection, flushed at the end of
+ * each message. Each chunk is decompressed as it is received. Compressed
+ * messages are binary whatever they hold, so the upgrade response also says
+ * how to parse them: JSON, or CBOR with "X-Policyd-Encoding: cbor".
+ */
+static bool decompressAppend(ZSTD_DCtx* dctx, const char* data, size_t size, std::string& out)
+{
+	ZSTD_inBuffer in = { data, size, 0 };
+	while (true)
+	{
+		size_t offset = out.size();
+		out.resize(offset + ZSTD_DStreamOutSize());
+		ZSTD_outBuffer o = { &out[offset], ZSTD_DStreamOutSize(), 0 };
+		size_t r = ZSTD_decompressStream(dctx, &o, &in);
+		out.resize(offset + o.pos);
+		if (ZSTD_isError(r))
+		{
+			syslog(LOG_CRIT, "policyd-client: Failed to decompress: %s", ZSTD_getErrorName(r));
+			return false;
 		}
+		Stats.bytes_decompressed += o.pos;
+		// a full output buffer may leave more to flush
+		if (in.pos == in.size && o.pos < o.size)
+			return true;
 	}
 }
 
-static void websocketWorker()
+// if the upgrade response has the header with this value
+static bool upgradeHeader(CURL* curl, const char* name, const char* value)
+{
+	struct curl_header* h;
+	return curl_easy_header(curl, name, 0, CURLH_HEADER | CURLH_1XX, -1, &h) == CURLHE_OK && strcasecmp(h->value, value) == 0;
+}
+
+// exponential backoff with jitter, from 100ms up to 30s
+static int reconnectDelay(unsigned int attempt)
+{
+	static std::mt19937 rng(std::random_device{}());
+	int cap = 100 << std::min(attempt, 9u);
+	if (cap > 30000)
+		cap = 30000;
+	return std::uniform_int_distribution<int>(cap / 2, cap)(rng);
+}
+
+static void websocketWorker(SyncState& state)
 {
-	std::set<UUID, UUIDCompare> uuid, uuid_last;
+	unsigned int attempt = 0;
+	size_t endpoint = 0;
+	bool connected_once = false;
+	uint64_t disconnected = 0;
+
+	CaptureWriter capture;
+	Pipeline pipeline;
+	pipeline.apply_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	pipeline.receive_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (!Config.capture.empty() && capture.open(Config.capture))
+		pipeline.capture = &capture;
+	std::thread applyThread([&state, &pipeline] { applyWorker(state, pipeline); });
+
 	while (!stop)
 	{
 		CURL* curl = curl_easy_init();
 		if (!curl)
 		{
 			syslog(LOG_CRIT, "policyd-client: could not initialize libcurl");
-			return;
+			break;
 		}
 
-		curl_easy_setopt(curl, CURLOPT_URL, Config.address.c_str());
+		// advertise protocol extensions supported by this client
+		struct curl_slist* headers = curl_slist_append(nullptr, "X-Policyd-Extensions: batch, revision, cbor, zstd");
+		if (state.revision)
+			headers = curl_slist_append(headers, ("X-Policyd-Revision: " + std::to_string(state.revision)).c_str());
+
+		const std::string& address = Config.addresses[endpoint];
+		curl_easy_setopt(curl, CURLOPT_URL, address.c_str());
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, Config.connect_timeout);
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 		curl_easy_setopt(curl, CURLOPT_CONNECT_ONLY, 2L);
 		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 		curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 300L);
 		CURLcode res = curl_easy_perform(curl);
 		if (res != CURLE_OK)
 		{
-			syslog(LOG_CRIT, "policyd-client: %s", curl_easy_strerror(res));
+			syslog(LOG_CRIT, "policyd-client: %s: %s", address.c_str(), curl_easy_strerror(res));
 			curl_easy_cleanup(curl);
-			sleep(1);
+			curl_slist_free_all(headers);
+			// fail over to the next endpoint right away, back off once all have failed
+			endpoint = (endpoint + 1) % Config.addresses.size();
+			if (endpoint == 0)
+				waitSocket(CURL_SOCKET_BAD, -1, reconnectDelay(attempt++));
 			continue;
 		}
-		syslog(LOG_INFO, "policyd-client: Connected");
-		error = false;
+		syslog(LOG_INFO, "policyd-client: Connected to %s", address.c_str());
+		if (connected_once)
+			Stats.reconnects++;
+		connected_once = true;
+
+		PipelineItem item{ PipelineEvent::CONNECTED, {} };
+		pipelinePush(pipeline, item);
+
+		curl_socket_t sockfd = CURL_SOCKET_BAD;
+		curl_easy_getinfo(curl, CURLINFO_ACTIVESOCKET, &sockfd);
+
+		// compressed payload can not be read without a context, so drop the connection
+		ZSTD_DCtx* dctx = nullptr;
+		bool receive = true;
+		bool cbor = false;
+		if (upgradeHeader(curl, "X-Policyd-Compression", "zstd"))
+		{
+			cbor = upgradeHeader(curl, "X-Policyd-Encoding", "cbor");
+			dctx = ZSTD_createDCtx();
+			receive = dctx != nullptr;
+			if (!receive)
+				syslog(LOG_CRIT, "policyd-client: Failed to create zstd context");
+		}
 
 		// connected
-		while (!stop)
+		std::string fullbuffer;
+		bool partial = false;
+		bool binary = false;
+		while (receive && !stop && !pipeline.drop)
 		{
-			std::string fullbuffer;
 			size_t rlen;
 			const struct curl_ws_frame* meta;
 			char buffer[65535];
-		read_more:
 			res = curl_ws_recv(curl, buffer, sizeof(buffer), &rlen, &meta);
 			if (res == CURLE_OK)
 			{
-				fullbuffer.append(buffer, rlen);
-				if (meta->bytesleft)
-					goto read_more;
-
-				Json::Value root;
-				Json::Reader reader;
-				reader.parse(fullbuffer, root);
-
-				if (root["action"].asString() == "VERSION")
-				{
-					if (root["version"].asUInt64() != 1)
-					{
-						syslog(LOG_CRIT, "policyd-client: Unsupported version of policyd");
-						stop = true;
-						error = true;
-						break;
-					}
-				}
-				if (root["action"].asString() == "CREATE")
-				{
-					if (root["policy"])
-					{
-						auto id = root["policy"]["id"].asString();
-
-						std::vector<const char*> properties;
-						if (root["policy"]["then"]["properties"])
-						{
-							for (auto i = root["policy"]["then"]["properties"].begin(); i != root["policy"]["then"]["properties"].end(); ++i)
-							{
-								properties.push_back(strdup(i.key().asCString()));
-								properties.push_back(strdup(i->asCString()));
-							}
-						}
-
-						if (uuid_last.find({ UUIDType::POLICY, id }) == uuid_last.end())
-						{
-							int type = HALONMTA_POLICY_TYPE_DYNAMIC;
-							if (root["policy"]["type"].asString() == "WARMUP")
-								type = HALONMTA_POLICY_TYPE_WARMUP;
-							if (root["policy"]["type"].asString() == "BACKOFF")
-								type = HALONMTA_POLICY_TYPE_BACKOFF;
-
-							int ratealgorithm = HALONMTA_RATE_ALGORITHM_DEFAULT;
-							if (root["policy"]["then"]["rate"]["algorithm"].asString() == "FIXEDWINDOW")
-								ratealgorithm = HALONMTA_RATE_ALGORITHM_FIXEDWINDOW;
-							if (root["policy"]["then"]["rate"]["algorithm"].asString() == "TOKENBUCKET")
-								ratealgorithm = HALONMTA_RATE_ALGORITHM_TOKENBUCKET;
-
-							int fields = 0;
-							std::vector<std::string> values;
-							for (auto i = root["policy"]["fields"].begin(); i != root["policy"]["fields"].end(); ++i)
-							{
-								if (i->asString() == "TRANSPORTID")
-								{
-									fields |= HALONMTA_QUEUE_TRANSPORTID;
-									values.push_back(root["policy"]["if"]["transportid"].isString() ? root["policy"]["if"]["transportid"].asString() : "");
-								}
-								if (i->asString() == "LOCALIP")
-								{
-									fields |= HALONMTA_QUEUE_LOCALIP;
-									/* not adding to values */
-								}
-								if (i->asString() == "REMOTEIP")
-								{
-									fields |= HALONMTA_QUEUE_REMOTEIP;
-									values.push_back(root["policy"]["if"]["remoteip"].isString() ? root["policy"]["if"]["remoteip"].asString() : "");
-								}
-								if (i->asString() == "REMOTEMX")
-								{
-									fields |= HALONMTA_QUEUE_REMOTEMX;
-									values.push_back(root["policy"]["if"]["remotemx"].isString() ? root["policy"]["if"]["remotemx"].asString() : "");
-								}
-								if (i->asString() == "RECIPIENTDOMAIN")
-								{
-									fields |= HALONMTA_QUEUE_RECIPIENTDOMAIN;
-									values.push_back(root["policy"]["if"]["recipientdomain"].isString() ? root["policy"]["if"]["recipientdomain"].asString() : "");
-								}
-								if (i->asString() == "JOBID")
-								{
-									fields |= HALONMTA_QUEUE_JOBID;
-									values.push_back(root["policy"]["if"]["jobid"].isString() ? root["policy"]["if"]["jobid"].asString() : "");
-								}
-								if (i->asString() == "GROUPING")
-								{
-									fields |= HALONMTA_QUEUE_GROUPING;
-									values.push_back(root["policy"]["if"]["grouping"].isString() ? root["policy"]["if"]["grouping"].asString() : "");
-								}
-								if (i->asString() == "TENANTID")
-								{
-									fields |= HALONMTA_QUEUE_TENANTID;
-									values.push_back(root["policy"]["if"]["tenantid"].isString() ? root["policy"]["if"]["tenantid"].asString() : "");
-								}
-							}
-
-							if (type == HALONMTA_POLICY_TYPE_WARMUP)
-							{
-								if (root["policy"]["if"]["localip"].isString())
-								{
-									warmups_mutex.lock();
-									warmups[root["policy"]["if"]["localip"].asString()]
-										.push_back({ fields,
-													 values,
-													 id,
-													 UUIDType::POLICY });
-									warmups_mutex.unlock();
-								}
-								else
-								{
-									syslog(LOG_CRIT, "policyd-client: policy of typ warmup was missing localip");
-								}
-							}
-
-							auto _id = HalonMTA_queue_policy_add6(
-								root["policy"]["id"].asString().c_str(),																			 // const chat* id
-								fields,																												 // int fields,
-								type,																												 // int type,
-								root["policy"]["if"]["transportid"].isString() ? root["policy"]["if"]["transportid"].asString().c_str() : 0,		 // const char* transportid,
-								root["policy"]["if"]["localip"].isString() ? root["policy"]["if"]["localip"].asString().c_str() : 0,				 // const char* localip,
-								root["policy"]["if"]["remoteip"].isString() ? root["policy"]["if"]["remoteip"].asString().c_str() : 0,				 // const char* remoteip,
-								root["policy"]["if"]["remotemx"].isString() ? root["policy"]["if"]["remotemx"].asString().c_str() : 0,				 // const char* remotemx,
-								root["policy"]["if"]["recipientdomain"].isString() ? root["policy"]["if"]["recipientdomain"].asString().c_str() : 0, // const char* recipientdomain,
-								root["policy"]["if"]["jobid"].isString() ? root["policy"]["if"]["jobid"].asString().c_str() : 0,					 // const char* jobid,
-								root["policy"]["if"]["grouping"].isString() ? root["policy"]["if"]["grouping"].asString().c_str() : 0,				 // const char* grouping,
-								root["policy"]["if"]["tenantid"].isString() ? root["policy"]["if"]["tenantid"].asString().c_str() : 0,				 // const char*tenantidtransportid,
-								root["policy"]["then"]["concurrency"].isNumeric() ? root["policy"]["then"]["concurrency"].asUInt64() : 0,			 // size_t concurrency,
-								root["policy"]["then"]["rate"]["count"].isNumeric() ? root["policy"]["then"]["rate"]["count"].asUInt64() : 0,		 // size_t tokens,
-								root["policy"]["then"]["rate"]["interval"].isNumeric() ? root["policy"]["then"]["rate"]["interval"].asDouble() : 0,	 // double interval,
-								ratealgorithm,																										 // int ratealgorithm
-								root["policy"]["then"]["connectinterval"].isNumeric() ? root["policy"]["then"]["connectinterval"].asDouble() : 0,	 // double connectinterval,
-								root["policy"]["then"]["tag"].isString() ? root["policy"]["then"]["tag"].asString().c_str() : nullptr,				 // const char* tag,
-								properties.size() ? &properties[0] : nullptr,																		 // const char* propv[],
-								properties.size(),																									 // size_t propl,
-								root["policy"]["then"]["stop"].isBool() ? root["policy"]["then"]["stop"].asBool() : false,							 // bool stop,
-								root["policy"]["then"]["cluster"].isBool() ? root["policy"]["then"]["cluster"].asBool() : true,						 // bool cluster,
-								root["policy"]["ttl"].isNumeric() ? root["policy"]["ttl"].asDouble() : 0											 // double ttl
-							);
-							error = _id == nullptr;
-							free(_id);
-						}
-						else
-						{
-							int ratealgorithm = HALONMTA_RATE_ALGORITHM_DEFAULT;
-							if (root["policy"]["then"]["rate"]["algorithm"].asString() == "fixedwindow")
-								ratealgorithm = HALONMTA_RATE_ALGORITHM_FIXEDWINDOW;
-							if (root["policy"]["then"]["rate"]["algorithm"].asString() == "tokenbucket")
-								ratealgorithm = HALONMTA_RATE_ALGORITHM_TOKENBUCKET;
-
-							error = !HalonMTA_queue_policy_update4(
-								root["policy"]["id"].asString().c_str(),
-								root["policy"]["then"]["concurrency"].isNumeric() ? root["policy"]["then"]["concurrency"].asUInt64() : 0,			// size_t concurrency,
-								root["policy"]["then"]["rate"]["count"].isNumeric() ? root["policy"]["then"]["rate"]["count"].asUInt64() : 0,		// size_t tokens,
-								root["policy"]["then"]["rate"]["interval"].isNumeric() ? root["policy"]["then"]["rate"]["interval"].asDouble() : 0, // double interval,
-								ratealgorithm,																										// int ratealgorithm
-								root["policy"]["then"]["connectinterval"].isNumeric() ? root["policy"]["then"]["connectinterval"].asDouble() : 0,	// double connectinterval,
-								root["policy"]["then"]["tag"].isString() ? root["policy"]["then"]["tag"].asString().c_str() : nullptr,				// const char* tag,
-								properties.size() ? &properties[0] : nullptr,																		// const char* propv[],
-								properties.size(),																									// size_t propl,
-								root["policy"]["then"]["stop"].isBool() ? root["policy"]["then"]["stop"].asBool() : false,							// bool stop,
-								root["policy"]["then"]["cluster"].isBool() ? root["policy"]["then"]["cluster"].asBool() : true,						// bool cluster,
-								root["policy"]["ttl"].isNumeric() ? root["policy"]["ttl"].asDouble() : 0											// double ttl
-							);
-						}
-
-						for (auto& i : properties)
-							free((void*)i);
-
-						if (error)
-						{
-							syslog(LOG_CRIT, "policyd-client: Failed to create policy: %s", root["policy"]["id"].asString().c_str());
-							if (!ready)
-								break;
-						}
-
-						uuid.insert({ UUIDType::POLICY, root["policy"]["id"].asString() });
-					}
-					else if (root["suspend"])
-					{
-						auto id = root["suspend"]["id"].asString();
-
-						std::vector<const char*> properties;
-						if (root["suspend"]["properties"])
-						{
-							for (auto i = root["suspend"]["properties"].begin(); i != root["suspend"]["properties"].end(); ++i)
-							{
-								properties.push_back(strdup(i.key().asCString()));
-								properties.push_back(strdup(i->asCString()));
-							}
-						}
-
-						if (uuid_last.find({ UUIDType::SUSPEND, id }) == uuid_last.end())
-						{
-							if (root["suspend"]["type"].asString() == "WARMUP")
-							{
-								if (root["suspend"]["localip"].isString())
-								{
-									warmups_mutex.lock();
-									warmups[root["suspend"]["localip"].asString()]
-										.push_back({ 0,
-													 {},
-													 id,
-													 UUIDType::SUSPEND });
-									warmups_mutex.unlock();
-								}
-								else
-								{
-									syslog(LOG_CRIT, "policyd-client: policy of typ warmup was missing localip");
-								}
-							}
-
-							auto _id = HalonMTA_queue_suspend_add5(
-								root["suspend"]["id"].asString().c_str(),
-								root["suspend"]["transportid"].isString() ? root["suspend"]["transportid"].asString().c_str() : nullptr,		 // const char* transportid,
-								root["suspend"]["localip"].isString() ? root["suspend"]["localip"].asString().c_str() : nullptr,				 // const char* localip,
-								root["suspend"]["remoteip"].isString() ? root["suspend"]["remoteip"].asString().c_str() : nullptr,				 // const char* remoteip,
-								root["suspend"]["remotemx"].isString() ? root["suspend"]["remotemx"].asString().c_str() : nullptr,				 // const char* remotemx,
-								root["suspend"]["recipientdomain"].isString() ? root["suspend"]["recipientdomain"].asString().c_str() : nullptr, // const char* recipientdomain,
-								root["suspend"]["jobid"].isString() ? root["suspend"]["jobid"].asString().c_str() : nullptr,					 // const char* jobid,
-								root["suspend"]["grouping"].isString() ? root["suspend"]["grouping"].asString().c_str() : nullptr,				 // const char* grouping,
-								root["suspend"]["tenantid"].isString() ? root["suspend"]["tenantid"].asString().c_str() : nullptr,				 // const char*tenantidtransportid,
-								root["suspend"]["tag"].isString() ? root["suspend"]["tag"].asString().c_str() : nullptr,						 // const char* tag,
-								properties.size() ? &properties[0] : nullptr,																	 // const char* propv[],
-								properties.size(),																								 // size_t propl,
-								root["suspend"]["ttl"].isNumeric() ? root["suspend"]["ttl"].asDouble() : 0										 // double ttl
-							);
-							error = _id == nullptr;
-							free(_id);
-						}
-
-						for (auto& i : properties)
-							free((void*)i);
-
-						if (error)
-						{
-							syslog(LOG_CRIT, "policyd-client: Failed to create suspend: %s", root["suspend"]["id"].asString().c_str());
-							if (!ready)
-								break;
-						}
-
-						uuid.insert({ UUIDType::SUSPEND, root["suspend"]["id"].asString() });
-					}
-					else
-					{
-						syslog(LOG_CRIT, "policyd-client: Failed to create unsupported type");
-						if (!ready)
-							break;
-						continue;
-					}
-				}
-				if (root["action"].asString() == "UPDATE")
-				{
-					if (!root["policy"])
-					{
-						syslog(LOG_CRIT, "policyd-client: Failed to delete unsupported type");
-						if (!ready)
-							break;
-						continue;
-					}
-
-					std::vector<const char*> properties;
-					if (root["policy"]["then"]["properties"])
-					{
-						for (auto i = root["policy"]["then"]["properties"].begin(); i != root["policy"]["then"]["properties"].end(); ++i)
-						{
-							properties.push_back(strdup(i.key().asCString()));
-							properties.push_back(strdup(i->asCString()));
-						}
-					}
-
-					int ratealgorithm = HALONMTA_RATE_ALGORITHM_DEFAULT;
-					if (root["policy"]["then"]["rate"]["algorithm"].asString() == "FIXEDWINDOW")
-						ratealgorithm = HALONMTA_RATE_ALGORITHM_FIXEDWINDOW;
-					if (root["policy"]["then"]["rate"]["algorithm"].asString() == "TOKENBUCKET")
-						ratealgorithm = HALONMTA_RATE_ALGORITHM_TOKENBUCKET;
-
-					error = !HalonMTA_queue_policy_update4(
-						root["policy"]["id"].asString().c_str(),
-						root["policy"]["then"]["concurrency"].isNumeric() ? root["policy"]["then"]["concurrency"].asUInt64() : 0,			// size_t concurrency,
-						root["policy"]["then"]["rate"]["count"].isNumeric() ? root["policy"]["then"]["rate"]["count"].asUInt64() : 0,		// size_t tokens,
-						root["policy"]["then"]["rate"]["interval"].isNumeric() ? root["policy"]["then"]["rate"]["interval"].asDouble() : 0, // double interval,
-						ratealgorithm,																										// int ratealgorithm
-						root["policy"]["then"]["connectinterval"].isNumeric() ? root["policy"]["then"]["connectinterval"].asDouble() : 0,	// double connectinterval,
-						root["policy"]["then"]["tag"].isString() ? root["policy"]["then"]["tag"].asString().c_str() : nullptr,				// const char* tag,
-						properties.size() ? &properties[0] : nullptr,																		// const char* propv[],
-						properties.size(),																									// size_t propl,
-						root["policy"]["then"]["stop"].isBool() ? root["policy"]["then"]["stop"].asBool() : false,							// bool stop,
-						root["policy"]["then"]["cluster"].isBool() ? root["policy"]["then"]["cluster"].asBool() : true,						// bool cluster,
-						root["policy"]["ttl"].isNumeric() ? root["policy"]["ttl"].asDouble() : 0											// double ttl
-					);
-
-					for (auto& i : properties)
-						free((void*)i);
-
-					if (error)
-					{
-						syslog(LOG_CRIT, "policyd-client: Failed to update policy: %s", root["policy"]["id"].asString().c_str());
-						if (!ready)
-							break;
-					}
-				}
-				if (root["action"].asString() == "DELETE")
+				if (!partial)
 				{
-					std::string id;
-					if (root["policy"])
-					{
-						id = root["policy"]["id"].asString();
-						error = !HalonMTA_queue_policy_delete(id.c_str());
-						if (error)
-						{
-							syslog(LOG_CRIT, "policyd-client: Failed to delete policy: %s", root["policy"]["id"].asString().c_str());
-							if (!ready)
-								break;
-						}
-						uuid.erase({ UUIDType::POLICY, id });
-						cleanupWarmup(UUIDType::POLICY, id);
-					}
-					else if (root["suspend"])
-					{
-						id = root["suspend"]["id"].asString();
-						error = !HalonMTA_queue_suspend_delete(id.c_str());
-						if (error)
-						{
-							syslog(LOG_CRIT, "policyd-client: Failed to delete suspend: %s", root["suspend"]["id"].asString().c_str());
-							// if (!ready)
-							//   break;
-						}
-						uuid.erase({ UUIDType::SUSPEND, id });
-						cleanupWarmup(UUIDType::SUSPEND, id);
-					}
-					else
-					{
-						syslog(LOG_CRIT, "policyd-client: Failed to delete unsupported type");
-						if (!ready)
-							break;
-					}
+					fullbuffer.clear();
+					// the opcode of a compressed message says nothing of what it holds
+					binary = dctx ? cbor : (meta->flags & CURLWS_BINARY) != 0;
 				}
-				if (root["action"].asString() == "SYNCED")
-				{
-					for (const auto& ul : uuid_last)
-					{
-						if (uuid.find(ul) == uuid.end())
-						{
-							switch (ul.type)
-							{
-								case UUIDType::POLICY:
-								{
-									bool ret = HalonMTA_queue_policy_delete(ul.id.c_str());
-									if (!ret)
-										syslog(LOG_CRIT, "policyd-client: Failed to delete policy: %s", ul.id.c_str());
-									cleanupWarmup(UUIDType::POLICY, ul.id);
-								}
-								break;
-								case UUIDType::SUSPEND:
-								{
-									bool ret = HalonMTA_queue_suspend_delete(ul.id.c_str());
-									if (!ret)
-										syslog(LOG_CRIT, "policyd-client: Failed to delete suspend: %s", ul.id.c_str());
-									cleanupWarmup(UUIDType::SUSPEND, ul.id);
-								}
-								break;
-							}
-						}
-					}
-					uuid_last.clear();
+				Stats.bytes_received += rlen;
+				if (!dctx)
+					fullbuffer.append(buffer, rlen);
+				else if (!decompressAppend(dctx, buffer, rlen, fullbuffer))
+					break;
+				partial = meta->bytesleft != 0;
+				if (partial)
+					continue;
 
-					if (error)
-						break;
-
-					ready = true;
-				}
+				item = { PipelineEvent::FRAME, std::move(fullbuffer), binary };
+				pipelinePush(pipeline, item);
 			}
 			else if (res == CURLE_AGAIN)
 			{
-				usleep(100000); // 100ms
+				waitSocket(sockfd, pipeline.receive_fd, -1);
 				continue;
 			}
 			else
@@ -491,15 +3845,38 @@ static void websocketWorker()
 			}
 		}
 
-		// saving old rules...
-		uuid_last.merge(uuid);
-		uuid.clear();
+		// wait for the apply thread to finish with this connection
+		item = { PipelineEvent::DISCONNECTED, {} };
+		pipelinePush(pipeline, item);
+		++disconnected;
+		while (pipeline.disconnected.load(std::memory_order_acquire) < disconnected)
+			waitEvent(pipeline.receive_fd, -1);
+
+		// prefer the first endpoint again when reconnecting
+		endpoint = 0;
 
 		// closing...
 		size_t sent;
 		(void)curl_ws_send(curl, "", 0, &sent, 0, CURLWS_CLOSE);
 		curl_easy_cleanup(curl);
+		ZSTD_freeDCtx(dctx);
+		curl_slist_free_all(headers);
+
+		// a connection that never got to SYNCED failed as much as one that was
+		// refused, the apply thread is done with it so its state can be read
+		if (state.synced)
+			attempt = 0;
+		else
+			waitSocket(CURL_SOCKET_BAD, -1, reconnectDelay(attempt++));
 	}
+
+	PipelineItem item{ PipelineEvent::QUIT, {} };
+	pipelinePush(pipeline, item);
+	applyThread.join();
+	if (pipeline.apply_fd >= 0)
+		close(pipeline.apply_fd);
+	if (pipeline.receive_fd >= 0)
+		close(pipeline.receive_fd);
 }
 
 HALON_EXPORT
@@ -513,17 +3890,59 @@ bool Halon_init(HalonInitContext* hic)
 {
 	HalonConfig* cfg;
 	HalonMTA_init_getinfo(hic, HALONMTA_INIT_CONFIG, nullptr, 0, &cfg, nullptr);
-	const char* address_ = HalonMTA_config_string_get(HalonMTA_config_object_get(cfg, "address"), nullptr);
+	HalonConfig* address = HalonMTA_config_object_get(cfg, "address");
+	const char* address_ = HalonMTA_config_string_get(address, nullptr);
 	if (address_)
-		Config.address = address_;
+		Config.addresses.push_back(address_);
+	else
+	{
+		HalonConfig* a;
+		for (size_t i = 0; (a = HalonMTA_config_array_get(address, i)); ++i)
+		{
+			address_ = HalonMTA_config_string_get(a, nullptr);
+			if (address_)
+				Config.addresses.push_back(address_);
+		}
+	}
+	if (Config.addresses.empty())
+	{
+		syslog(LOG_CRIT, "policyd-client: No address configured");
+		return false;
+	}
+	const char* connect_timeout_ = HalonMTA_config_string_get(HalonMTA_config_object_get(cfg, "connect_timeout"), nullptr);
+	if (connect_timeout_)
+		Config.connect_timeout = (long)(strtod(connect_timeout_, nullptr) * 1000);
+	const char* update_window_ = HalonMTA_config_string_get(HalonMTA_config_object_get(cfg, "update_window"), nullptr);
+	if (update_window_)
+		Config.update_window = (long)(strtod(update_window_, nullptr) * 1000);
+	const char* cache_ = HalonMTA_config_string_get(HalonMTA_config_object_get(cfg, "cache"), nullptr);
+	if (cache_)
+		Config.cache = cache_;
+	const char* capture_ = HalonMTA_config_string_get(HalonMTA_config_object_get(cfg, "capture"), nullptr);
+	if (capture_)
+		Config.capture = capture_;
+
+	stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (stop_fd < 0)
+		syslog(LOG_WARNING, "policyd-client: eventfd failed, falling back to polling");
 
-	websocketThread = std::thread([] { websocketWorker(); });
+	// with a cache, policies are applied right away and reconciled in the background
+	SyncState state;
+	if (!Config.cache.empty() && loadCache(state))
+		ready = true;
+
+	websocketThread = std::thread([state = std::move(state)]() mutable { websocketWorker(state); });
 	while (!ready && !error)
 		usleep(100000);
 	if (error)
 	{
 		if (websocketThread.joinable())
 			websocketThread.join();
+		if (stop_fd >= 0)
+		{
+			close(stop_fd);
+			stop_fd = -1;
+		}
 		syslog(LOG_CRIT, "policyd-client: Failed to sync policies");
 		return false;
 	}
@@ -533,73 +3952,83 @@ bool Halon_init(HalonInitContext* hic)
 HALON_EXPORT
 bool Halon_queue_insert_callback(HalonQueueContext* hqc)
 {
+	HistogramTimer timer(Stats.insert);
+
 	char** localips;
 	size_t localips_count;
 	HalonMTA_queue_getinfo(hqc, HALONMTA_INFO_LOCALIPS, nullptr, 0, &localips, &localips_count);
 
-	bool modified = false;
-	HalonQueueMessage* hqm = nullptr;
-	std::vector<std::string> localips_touse;
+	const warmupSnapshot* snapshot = &warmupsRead();
+	if (snapshot->localips.empty() && snapshot->lazy.empty())
+		return true;
 
-	std::map<size_t, std::string> value_cache;
+	// only spill to the heap for unusually large ip pools
+	const char* localips_stack[64];
+	std::vector<const char*> localips_heap;
+	const char** localips_touse = localips_stack;
+	if (localips_count > sizeof(localips_stack) / sizeof(localips_stack[0]))
+	{
+		localips_heap.resize(localips_count);
+		localips_touse = localips_heap.data();
+	}
+	size_t localips_touse_count = 0;
 
-	warmups_mutex.lock();
-	for (size_t i = 0; i < localips_count; ++i)
+	// only the fields used by some condition are fetched
+	std::string_view values[warmupFieldsCount];
+	if (snapshot->fields)
 	{
-		auto w = warmups.find(localips[i]);
-		if (w == warmups.end())
-		{
-			localips_touse.push_back(localips[i]);
-			continue;
-		}
+		HalonQueueMessage* hqm;
+		HalonMTA_queue_getinfo(hqc, HALONMTA_INFO_MESSAGE, nullptr, 0, &hqm, nullptr);
+		warmupMessageValues(hqm, snapshot->fields, values);
+	}
+	std::string_view memo_key[warmupFieldsCount];
+	size_t memo_key_count = warmupCompare(snapshot->fields, values, memo_key);
+
+	// the same pool and values give the same decision within a generation
+	char memo_entry_key[memoKeySize];
+	size_t memo_entry_size = 0;
+	bool memoize = memoKey(localips, localips_count, memo_key, memo_key_count, memo_entry_key, memo_entry_size);
+	size_t hash = memoize ? std::hash<std::string_view>()(std::string_view(memo_entry_key, memo_entry_size)) : 0;
+	uint64_t touse = 0;
+	if (memoize && memoGet(snapshot->generation, hash, memo_entry_key, memo_entry_size, touse))
+	{
+		Stats.insert_memo_hits.fetch_add(1, std::memory_order_relaxed);
+		for (size_t i = 0; i < localips_count; ++i)
+			if (touse & (1ULL << i))
+				localips_touse[localips_touse_count++] = localips[i];
+	}
+	else
+	{
+		Stats.insert_memo_misses.fetch_add(1, std::memory_order_relaxed);
 
-		// if matching.. add... or set modified = true
-		bool match = false;
-		for (const auto& condition : w->second)
+		for (size_t i = 0; i < localips_count; ++i)
 		{
-			std::vector<std::string> compare;
-			for (const auto& p : (std::vector<std::pair<size_t, int>>){
-					 { HALONMTA_QUEUE_TRANSPORTID, HALONMTA_MESSAGE_TRANSACTIONID },
-					 { HALONMTA_QUEUE_REMOTEIP, HALONMTA_MESSAGE_REMOTEIP },
-					 { HALONMTA_QUEUE_REMOTEMX, HALONMTA_MESSAGE_REMOTEMX },
-					 { HALONMTA_QUEUE_RECIPIENTDOMAIN, HALONMTA_MESSAGE_RECIPIENTDOMAIN },
-					 { HALONMTA_QUEUE_JOBID, HALONMTA_MESSAGE_JOBID },
-					 { HALONMTA_QUEUE_GROUPING, HALONMTA_MESSAGE_GROUPING },
-					 { HALONMTA_QUEUE_TENANTID, HALONMTA_MESSAGE_TENANTID },
-				 })
-			{
-				if (condition.fields & p.first)
-				{
-					if (value_cache.find(p.first) == value_cache.end())
-					{
-						if (!hqm)
-							HalonMTA_queue_getinfo(hqc, HALONMTA_INFO_MESSAGE, nullptr, 0, &hqm, nullptr);
-						size_t vl;
-						const char* v;
-						HalonMTA_message_getinfo(hqm, p.second, nullptr, 0, &v, &vl);
-						value_cache[p.first] = std ::string(v, vl);
-					}
-					compare.push_back(value_cache[p.first]);
-				}
-			}
-			if (condition.values == compare)
+			// the entries of a large prefix are added for the ips seen in it
+			warmupAddress address;
+			int length;
+			if (!snapshot->lazy.empty() && parseAddress(localips[i], address, length) && snapshot->lazyPrefixes.find(address) &&
+				!prefixQueue(snapshot->generation, address))
+				memoize = false;
+
+			// ips without warmup are kept, the others only if a condition matches
+			const warmupPool* pool = findWarmup(*snapshot, localips[i]);
+			if (!pool || warmupMatch(*pool, values))
 			{
-				match = true;
-				break;
+				localips_touse[localips_touse_count++] = localips[i];
+				touse |= i < 64 ? 1ULL << i : 0;
 			}
 		}
-
-		if (!match)
-			modified = true;
-		else
-			localips_touse.push_back(localips[i]);
+		if (memoize)
+			memoPut(snapshot->generation, hash, memo_entry_key, memo_entry_size, touse);
 	}
-	warmups_mutex.unlock();
 
+	bool modified = localips_touse_count != localips_count;
 	if (modified)
 	{
-		if (localips_touse.empty())
+		Stats.insert_ips_filtered.fetch_add(localips_count - localips_touse_count, std::memory_order_relaxed);
+		if (localips_touse_count == 0)
 		{
+			Stats.insert_no_ips.fetch_add(1, std::memory_order_relaxed);
 			HalonHSLValue* ret;
 			HalonMTA_queue_getinfo(hqc, HALONMTA_INFO_RETURN, NULL, 0, &ret, NULL);
 			HalonMTA_hsl_value_set(ret, HALONMTA_HSL_TYPE_ARRAY, nullptr, 0);
@@ -609,20 +4038,170 @@ bool Halon_queue_insert_callback(HalonQueueContext* hqc)
 			HalonMTA_hsl_value_set(val, HALONMTA_HSL_TYPE_STRING, "NO_IPS", 0);
 			return false;
 		}
-		const char** localips2 = new const char*[localips_touse.size()];
-		for (size_t i = 0; i < localips_touse.size(); ++i)
-			localips2[i] = localips_touse[i].c_str();
-		HalonMTA_queue_setinfo(hqc, HALONMTA_INFO_LOCALIPS, localips2, localips_touse.size());
-		delete[] localips2;
+		HalonMTA_queue_setinfo(hqc, HALONMTA_INFO_LOCALIPS, localips_touse, localips_touse_count);
+	}
+
+	return true;
+}
+
+static HalonHSLValue* statsAdd(HalonHSLValue* array, const char* name)
+{
+	HalonHSLValue *key, *val;
+	HalonMTA_hsl_value_array_add(array, &key, &val);
+	HalonMTA_hsl_value_set(key, HALONMTA_HSL_TYPE_STRING, name, 0);
+	return val;
+}
+
+static void statsAdd(HalonHSLValue* array, const char* name, double value)
+{
+	HalonMTA_hsl_value_set(statsAdd(array, name), HALONMTA_HSL_TYPE_NUMBER, &value, 0);
+}
+
+static void statsAdd(HalonHSLValue* array, const char* name, const Histogram& histogram)
+{
+	HalonHSLValue* val = statsAdd(array, name);
+	HalonMTA_hsl_value_set(val, HALONMTA_HSL_TYPE_ARRAY, nullptr, 0);
+	statsAdd(val, "count", (double)histogram.count.load());
+	statsAdd(val, "sum", (double)histogram.sum.load() / 1e9);
+	// bucket i counts what took less than 2^i microseconds
+	HalonHSLValue* buckets = statsAdd(val, "buckets");
+	HalonMTA_hsl_value_set(buckets, HALONMTA_HSL_TYPE_ARRAY, nullptr, 0);
+	for (size_t i = 0; i < Histogram::size; ++i)
+	{
+		HalonHSLValue *k, *v;
+		HalonMTA_hsl_value_array_add(buckets, &k, &v);
+		double index = (double)i, count = (double)histogram.buckets[i].load();
+		HalonMTA_hsl_value_set(k, HALONMTA_HSL_TYPE_NUMBER, &index, 0);
+		HalonMTA_hsl_value_set(v, HALONMTA_HSL_TYPE_NUMBER, &count, 0);
+	}
+}
+
+static void policyd_client_stats(HalonHSLContext* hhc, HalonHSLArguments* args, HalonHSLValue* ret)
+{
+	HalonMTA_hsl_value_set(ret, HALONMTA_HSL_TYPE_ARRAY, nullptr, 0);
+
+	HalonHSLValue* frames = statsAdd(ret, "frames");
+	HalonMTA_hsl_value_set(frames, HALONMTA_HSL_TYPE_ARRAY, nullptr, 0);
+	statsAdd(frames, "VERSION", (double)Stats.frames[(size_t)FrameAction::VERSION].load());
+	statsAdd(frames, "CREATE", (double)Stats.frames[(size_t)FrameAction::CREATE].load());
+	statsAdd(frames, "UPDATE", (double)Stats.frames[(size_t)FrameAction::UPDATE].load());
+	statsAdd(frames, "DELETE", (double)Stats.frames[(size_t)FrameAction::DELETE].load());
+	statsAdd(frames, "SYNCED", (double)Stats.frames[(size_t)FrameAction::SYNCED].load());
+	statsAdd(frames, "BATCH", (double)Stats.batches.load());
+	statsAdd(frames, "unknown", (double)Stats.frames[(size_t)FrameAction::UNKNOWN].load());
+
+	statsAdd(ret, "ready", ready ? 1 : 0);
+	statsAdd(ret, "reconnects", (double)Stats.reconnects.load());
+	statsAdd(ret, "bytes_received", (double)Stats.bytes_received.load());
+	statsAdd(ret, "bytes_decompressed", (double)Stats.bytes_decompressed.load());
+	statsAdd(ret, "sync_duration", (double)Stats.sync_duration.load() / 1e9);
+	HalonHSLValue* ids = statsAdd(ret, "ids");
+	HalonMTA_hsl_value_set(ids, HALONMTA_HSL_TYPE_ARRAY, nullptr, 0);
+	uint64_t ids_count = Stats.ids.load(), ids_memory = Stats.ids_memory.load();
+	statsAdd(ids, "count", (double)ids_count);
+	statsAdd(ids, "memory", (double)ids_memory);
+	statsAdd(ids, "memory_per_id", ids_count ? (double)ids_memory / (double)ids_count : 0);
+	statsAdd(ids, "expiring", (double)Stats.ids_expiring.load());
+	statsAdd(ids, "expired", (double)Stats.expired.load());
+	statsAdd(ret, "updates_applied", (double)Stats.updates_applied.load());
+	statsAdd(ret, "updates_skipped", (double)Stats.updates_skipped.load());
+	statsAdd(ret, "updates_coalesced", (double)Stats.updates_coalesced.load());
+	statsAdd(ret, "updates_cancelled", (double)Stats.updates_cancelled.load());
+	statsAdd(ret, "queue_full", (double)Stats.queue_full.load());
+	statsAdd(ret, "queue_max", (double)Stats.queue_max.load());
+	statsAdd(ret, "queue_wait", Stats.queue_wait);
+	statsAdd(ret, "capture_dropped", (double)Stats.capture_dropped.load());
+	statsAdd(ret, "decode_threads", (double)Stats.decode_threads.load());
+	statsAdd(ret, "decode_parallel", (double)Stats.decode_parallel.load());
+	statsAdd(ret, "parse", Stats.parse);
+	statsAdd(ret, "policy_add", Stats.policy_add);
+	statsAdd(ret, "policy_update", Stats.policy_update);
+	statsAdd(ret, "policy_delete", Stats.policy_delete);
+	statsAdd(ret, "suspend_add", Stats.suspend_add);
+	statsAdd(ret, "suspend_delete", Stats.suspend_delete);
+
+	const warmupSnapshot* snapshot = &warmupsRead();
+	size_t conditions = 0;
+	for (const auto& i : snapshot->localips)
+		conditions += i.second->items[UUIDType::SUSPEND].size() + i.second->items[UUIDType::POLICY].size();
+	HalonHSLValue* warmup = statsAdd(ret, "warmups");
+	HalonMTA_hsl_value_set(warmup, HALONMTA_HSL_TYPE_ARRAY, nullptr, 0);
+	statsAdd(warmup, "generation", (double)snapshot->generation);
+	statsAdd(warmup, "localips", (double)snapshot->localips.size());
+	statsAdd(warmup, "conditions", (double)conditions);
+
+	HalonHSLValue* insert = statsAdd(ret, "insert");
+	HalonMTA_hsl_value_set(insert, HALONMTA_HSL_TYPE_ARRAY, nullptr, 0);
+	statsAdd(insert, "ips_filtered", (double)Stats.insert_ips_filtered.load());
+	statsAdd(insert, "no_ips", (double)Stats.insert_no_ips.load());
+	statsAdd(insert, "memo_hits", (double)Stats.insert_memo_hits.load());
+	statsAdd(insert, "memo_misses", (double)Stats.insert_memo_misses.load());
+	statsAdd(insert, "latency", Stats.insert);
+	statsAdd(ret, "ips", Stats.ips);
+}
+
+static void ipsAdd(HalonHSLValue* array, double index, const char* ip)
+{
+	HalonHSLValue *key, *val;
+	HalonMTA_hsl_value_array_add(array, &key, &val);
+	HalonMTA_hsl_value_set(key, HALONMTA_HSL_TYPE_NUMBER, &index, 0);
+	HalonMTA_hsl_value_set(val, HALONMTA_HSL_TYPE_STRING, ip, 0);
+}
+
+/*
+ * The source ips eligible for the message being delivered, by the current
+ * warmups. The pool of the message is given as an array of candidate ips,
+ * since it cannot be read from a delivery context, and is filtered like
+ * Halon_queue_insert_callback does, keeping ips without warmup. Without it
+ * nothing is returned, leaving the source ip to the transport.
+ */
+static void policyd_client_ips(HalonHSLContext* hhc, HalonHSLArguments* args, HalonHSLValue* ret)
+{
+	HistogramTimer timer(Stats.ips);
+
+	HalonHSLValue* candidates = HalonMTA_hsl_argument_get(args, 0);
+	if (!candidates || HalonMTA_hsl_value_type(candidates) != HALONMTA_HSL_TYPE_ARRAY)
+		return;
+
+	HalonQueueMessage* hqm = nullptr;
+	if (!HalonMTA_hsl_context_getinfo(hhc, HALONMTA_INFO_MESSAGE, nullptr, 0, &hqm, nullptr) || !hqm)
+		return;
+
+	const warmupSnapshot* snapshot = &warmupsRead();
+	std::string_view values[warmupFieldsCount];
+	warmupMessageValues(hqm, snapshot->fields, values);
+	HalonMTA_hsl_value_set(ret, HALONMTA_HSL_TYPE_ARRAY, nullptr, 0);
+
+	double index = 0;
+	HalonHSLValue *k, *v;
+	for (size_t i = 0; HalonMTA_hsl_value_array_get(candidates, i, &k, &v); ++i)
+	{
+		char* ip;
+		if (HalonMTA_hsl_value_type(v) != HALONMTA_HSL_TYPE_STRING || !HalonMTA_hsl_value_get(v, HALONMTA_HSL_TYPE_STRING, &ip, nullptr))
+			continue;
+		const warmupPool* pool = findWarmup(*snapshot, ip);
+		if (!pool || warmupMatch(*pool, values))
+			ipsAdd(ret, index++, ip);
 	}
+}
 
+HALON_EXPORT
+bool Halon_hsl_register(HalonHSLRegisterContext* hhrc)
+{
+	HalonMTA_hsl_register_function(hhrc, "policyd-client_stats", &policyd_client_stats);
+	HalonMTA_hsl_register_function(hhrc, "policyd-client_ips", &policyd_client_ips);
 	return true;
 }
 
 HALON_EXPORT
 void Halon_cleanup()
 {
-	stop = true;
+	requestStop();
 	if (websocketThread.joinable())
 		websocketThread.join();
+	if (stop_fd >= 0)
+	{
+		close(stop_fd);
+		stop_fd = -1;
+	}
 }